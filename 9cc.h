@@ -2,19 +2,58 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct Type Type;
 typedef struct Node Node;
+typedef struct HashMap HashMap;
+
+#define unreachable() \
+    error("internal error at %s:%d", __FILE__, __LINE__)
+
+//
+// arena.c
+//
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    char *name;
+    ArenaChunk *chunks;
+    size_t used;      // bytes handed out, in total
+    size_t reserved;  // bytes currently obtained from the OS
+    size_t peak;      // largest value of reserved
+} Arena;
+
+// Each thread compiles its own file, so arenas are per thread.
+extern _Thread_local Arena token_arena;   // Token and string literal contents
+extern _Thread_local Arena list_arena;    // Token lists until preprocess_toplevel() packs them
+extern _Thread_local Arena node_arena;    // Node, local Obj and block scopes
+extern _Thread_local Arena type_arena;    // Type
+extern _Thread_local Arena global_arena;  // global Obj and file scope
+extern bool opt_hugepages;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_merge(Arena *dst, Arena *src);
+void *array_grow(void *p, size_t size);
+void arena_adopt(Arena *arena, void *p, size_t used);
+void arena_release(Arena *arena);
+void arena_release_all(void);
+void print_arena_stats(FILE *out);
 
 //
 // strings.c
 //
 char *format(char *fmt, ...);
+char *intern(char *s, int len);
+size_t intern_size(void);
+void intern_reset(void);
 
 //
 // tokenizer.c
@@ -29,25 +68,116 @@ typedef enum {
     TK_EOF,      // 入力の終わりを表すトークン
 } TokenKind;
 
+// 記号とキーワードの番号 (Token::id)。トークナイズ時に振っておき、パーサは
+// 文字列ではなく番号で比べる。1文字の記号はその文字自身を番号とし、
+// 2文字の記号とキーワードには128以降を振る
+enum {
+    P_EQ = 128,  // ==
+    P_NE,        // !=
+    P_LE,        // <=
+    P_GE,        // >=
+    P_HASHHASH,  // ##
+    P_LOGAND,    // &&
+    P_LOGOR,     // ||
+    P_SHL,       // <<
+    P_SHR,       // >>
+    KW_RETURN,
+    KW_IF,
+    KW_ELSE,
+    KW_FOR,
+    KW_WHILE,
+    KW_INT,
+    KW_CHAR,
+    KW_SIZEOF,
+    TOKEN_ID_END,
+};
+
+// 文字列リテラルの中身。トークンには載せず別に持つ
+typedef struct {
+    char *data;      // '\0'を含む文字列リテラル
+    int len;         // 終端の'\0'を含む長さ
+} StrLiteral;
+
 // トークン型
+// トークン列は大量に作られるので、種類ごとに必要な値だけを共用体に持たせて
+// 32バイトに収めている。プリプロセッサまではnextでつないだリストとして扱い、
+// preprocess_toplevel()がパーサに渡すときに1つの配列に詰め直す
 typedef struct Token Token;
 struct Token {
-    TokenKind kind;  // トークンの型
+    TokenKind kind : 8;  // トークンの型
+    bool at_bol : 1;     // 行頭のトークンか
+    bool has_space : 1;  // 前に空白があるか
+    bool noexpand : 1;   // マクロとして展開しない識別子か
+    unsigned id : 8;     // TK_PUNCT/TK_KEYWORDの番号、それ以外は0
+    int len;             // トークン長さ
     Token *next;     // 次の入力トークン
-    int val;         // kindがTK_NUMの場合、その数値
     char *loc;       // トークン位置
-    int len;         // トークン長さ
-    Type *ty;        // TK_STRの場合に使用
-    char *str;       // '\0'を含む文字列リテラル
+    union {
+        int val;          // TK_NUMの場合、その数値
+        char *name;       // TK_IDENT/TK_KEYWORDの場合、intern済みの識別子
+        StrLiteral *str;  // TK_STRの場合
+    };
 };
 
-void error(char *fmt, ...);
-void error_at(char *loc, char *fmt, ...);
-void error_tok(Token *tok, char *fmt, ...);
+// Errors are printed to stderr and end the process unless error_file
+// and error_jmp say otherwise (lib9cc returns them to the caller).
+extern _Thread_local FILE *error_file;
+extern _Thread_local jmp_buf *error_jmp;
+
+_Noreturn void error(char *fmt, ...);
+_Noreturn void error_at(char *loc, char *fmt, ...);
+_Noreturn void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
+bool equal_id(Token *tok, int id);
+Token *skip_id(Token *tok, int id);
+bool consume_id(Token **rest, Token *tok, int id);
+char *token_id_name(int id);
+char *read_file(char *path);
+char *read_file2(char *path, size_t *mapped);
+char *read_input(char *path);
+void add_input_file(char *name, char *contents);
+char *input_file_name(char *loc);
 Token *tokenize_file(char *filename);
+Token *tokenize_string(char *filename, char *p);
+Token *tokenize_include(char *path, char *p);
+char *toplevel_end(char *p);
+Token *tokenize_span(char *start, char *end);
+Token *tokenize_toplevel(char **rest);
+
+// -j: 並列に使うスレッド数 (トークナイズとコード生成)
+extern int opt_jobs;
+
+//
+// preprocess.c
+//
+
+typedef struct {
+    char *name;
+    bool is_objlike;
+    char **params;
+    int nparams;
+    Token *body;     // ends with TK_EOF
+    bool disabled;   // its replacement is being rescanned
+} Macro;
+
+void add_include_path(char *dir);
+char **get_include_paths(int *count);
+void set_include_dirs(char *cwd, char **paths, int npaths);
+void reset_include_dirs(void);
+size_t header_cache_size(void);
+void header_cache_reset(void);
+Token *preprocess(Token *tok);
+void preprocess_begin(void);
+Token *preprocess_toplevel(Token *tok);
+Token *concat_tokens(Token *tok, Token *tok2);
+void preprocess_end(void);
+uint64_t preprocess_state(void);
+char *preprocess_deps(void);
+void add_dependency(char *path, char *digest);
+void define_macro(Macro *m);
+HashMap *macro_table(void);
 
 //
 // parse.c
@@ -66,11 +196,13 @@ struct Obj {
 
     // global variable/function
     bool is_function;
+    Token *tok;    // 定義の位置 (プリコンパイル済みヘッダ由来ならNULL)
 
     // global variable
     char *init_data;
 
     // function
+    Obj *literals; // 関数内の文字列リテラル
     Obj *params;
     Node *body;
     Obj *locals;
@@ -103,35 +235,51 @@ typedef enum {
 } NodeKind;
 
 // 抽象構文木のノードの型
+// kindごとに使うフィールドは決まっているので、共用体で重ねて持つ
 struct Node {
     NodeKind kind;  // ノードの型
     Node *next;     // next node
     Type *ty;       // Type
     Token *tok;     // 代表トークン
 
-    Node *lhs;      // 左辺
-    Node *rhs;      // 右辺
+    union {
+        // 演算子、return、式文
+        struct {
+            Node *lhs;      // 左辺
+            Node *rhs;      // 右辺
+        };
 
-    // "if" or "for" statement
-    Node *cond;
-    Node *then;
-    Node *els;
-    Node *init;
-    Node *inc;
+        // "if" or "for" statement
+        struct {
+            Node *cond;
+            Node *then;
+            Node *els;
+            Node *init;
+            Node *inc;
+        };
 
-    // Block or statement expression
-    Node *body;
+        // Block or statement expression
+        Node *body;
 
-    // 関数呼び出し
-    char *funcname;
-    Node *args;
+        // 関数呼び出し
+        struct {
+            char *funcname;
+            Node *args;
+        };
 
-    Obj *var;       // kind == ND_VARのとき使用
-    int val;        // kind == ND_NUMのとき使用
+        Obj *var;       // kind == ND_VARのとき使用
+        int val;        // kind == ND_NUMのとき使用
+    };
 };
 
 Obj *parse(Token *tok);
+void parse_begin(void);
+Obj *parse_toplevel(Token *tok);
+char *function_name(Token *tok);
+Obj *declare_function(Token *tok);
+Obj *declare_global(char *name, Type *ty);
 
+extern _Thread_local HashMap *referenced_globals;
 
 //
 // type.c
@@ -145,6 +293,9 @@ typedef enum {
     TY_ARRAY,
 } TypeKind;
 
+// Pointer and array types are interned: pointer_to() and array_of()
+// return the same Type for the same arguments, so such types can be
+// compared with ==. Function types and parameter copies are not shared.
 struct Type {
     TypeKind kind;
     int size;      // sizeof() value
@@ -152,9 +303,17 @@ struct Type {
     // Pointer-to or array-of
     Type *base;
 
-    // Declaration
+    // Parameter name (set only on the copies made for a parameter list)
     Token *name;
 
+    // copy_type()'s original type
+    Type *origin;
+
+    // Interned derived types
+    Type *pointer;     // pointer_to(this)
+    Type *arrays;      // array_of(this, n), linked by array_next
+    Type *array_next;
+
     // Array
     int array_len;
 
@@ -164,18 +323,122 @@ struct Type {
     Type *next;
 };
 
-extern Type *ty_char;
-extern Type *ty_int;
+// Built-in types are per thread because derived types are cached on them
+// and allocated from the thread's type_arena.
+extern _Thread_local Type builtin_char;
+extern _Thread_local Type builtin_int;
+
+#define ty_char (&builtin_char)
+#define ty_int (&builtin_int)
 
 bool is_integer(Type *ty);
 Type *copy_type(Type *ty);
 Type *pointer_to(Type *base);
 Type *func_type(Type *return_ty);
 Type *array_of(Type *base, int len);
+void release_types(void);
 void add_type(Node *node);
 
+//
+// hashmap.c
+//
+
+typedef struct {
+    char *key;
+    int keylen;
+    void *val;
+} HashEntry;
+
+struct HashMap {
+    HashEntry *buckets;
+    int capacity;
+    int used;
+};
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void hashmap_delete(HashMap *map, char *key);
+void hashmap_delete2(HashMap *map, char *key, int keylen);
+
 //
 // codegen.c
 //
 
 void codegen(Obj *prog, FILE *out);
+void codegen_begin(FILE *out);
+void codegen_function(Obj *fn);
+char *codegen_function_buf(Obj *fn, size_t *len);
+void codegen_text(char *text, size_t len);
+void codegen_end(void);
+void codegen_data(Obj *prog);
+void codegen_object(Obj *prog, FILE *out);
+
+//
+// elf.c
+//
+
+void elf_begin(void);
+void elf_section(bool is_text);
+void elf_bytes(void *p, size_t len);
+void elf_zero(size_t len);
+void elf_symbol(char *name);
+void elf_reloc(char *name, int type, int64_t addend);
+void elf_label(int id);
+void elf_jump(bool cond, int id);
+void elf_function_end(void);
+void elf_write(FILE *out);
+
+//
+// whole.c
+//
+
+Obj *link_program(Obj **progs, int n, int *nremoved);
+
+//
+// jit.c
+//
+
+int jit_run(Obj *prog, char *path, char **paths, int npaths);
+
+//
+// server.c
+//
+
+extern size_t opt_server_memory;
+
+void serve(char *socket_path);
+char *compile_remote(char *socket_path, char *path, char *src, size_t *len);
+
+//
+// cache.c
+//
+
+extern char *opt_cache;
+extern size_t opt_cache_size;
+
+long long now_ns(void);
+char *digest(void *p, size_t len);
+char *compiler_digest(void);
+bool file_matches(char *path, char *digest);
+char *cache_key(char *path, char *p, bool stream);
+char *cache_load(char *key, size_t *len);
+void cache_store(char *key, char *buf, size_t len, long long elapsed_ns, char *deps);
+void print_cache_stats(FILE *out);
+
+//
+// pch.c
+//
+
+bool pch_include(char *header_path);
+size_t pch_cache_size(void);
+void pch_cache_reset(void);
+void write_pch(char *path, char *output);
+
+//
+// incremental.c
+//
+
+Obj *parse_incremental(char *p, char *db_path);
+void codegen_incremental(Obj *prog, FILE *out, char *db_path);
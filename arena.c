@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include "9cc.h"
+#include <sys/mman.h>
+
+// Bump-pointer allocator. Every front-end object is carved out of a
+// large chunk so that allocation is a pointer increment and objects
+// created together sit next to each other in memory. An arena is freed
+// as a whole by arena_release().
+
+#define CHUNK_SIZE (2 * 1024 * 1024)
+#define ALIGN 8
+#define HEADER_SIZE ((sizeof(ArenaChunk) + ALIGN - 1) / ALIGN * ALIGN)
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    char *cur;
+    char *end;
+};
+
+_Thread_local Arena token_arena = {"token"};
+_Thread_local Arena list_arena = {"token list"};
+_Thread_local Arena node_arena = {"ast"};
+_Thread_local Arena type_arena = {"type"};
+_Thread_local Arena global_arena = {"global"};
+
+bool opt_hugepages;
+
+static void update_peak(Arena *arena) {
+    if (arena->peak < arena->reserved)
+        arena->peak = arena->reserved;
+}
+
+// Chunks of the usual size freed by arena_release(), kept until
+// arena_release_all() so that the pages they have touched, which are
+// zeroed again, can be reused without new page faults.
+static _Thread_local ArenaChunk *free_chunks;
+
+static ArenaChunk *new_chunk(size_t size) {
+    if (size == CHUNK_SIZE && free_chunks) {
+        ArenaChunk *chunk = free_chunks;
+        free_chunks = chunk->next;
+        chunk->next = NULL;
+        chunk->cur = (char *)chunk + HEADER_SIZE;
+        return chunk;
+    }
+
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        error("out of memory: %s", strerror(errno));
+    if (opt_hugepages)
+        madvise(p, size, MADV_HUGEPAGE);
+
+    ArenaChunk *chunk = (ArenaChunk *)p;
+    chunk->size = size;
+    chunk->cur = p + HEADER_SIZE;
+    chunk->end = p + size;
+    return chunk;
+}
+
+// Returns zero-initialized memory that lives until the arena is released.
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ALIGN - 1) / ALIGN * ALIGN;
+
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->end - chunk->cur < size) {
+        size_t chunk_size = CHUNK_SIZE;
+        if (size + HEADER_SIZE > chunk_size)
+            chunk_size = (size + HEADER_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+
+        chunk = new_chunk(chunk_size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->reserved += chunk_size;
+        update_peak(arena);
+    }
+
+    void *p = chunk->cur;
+    chunk->cur += size;
+    arena->used += size;
+    return p;
+}
+
+// Moves all chunks of src to dst, so that objects allocated from src
+// live as long as dst does. src becomes empty.
+void arena_merge(Arena *dst, Arena *src) {
+    if (!src->chunks)
+        return;
+
+    // Append to the end so that dst keeps bumping in its current chunk.
+    ArenaChunk **p = &dst->chunks;
+    while (*p)
+        p = &(*p)->next;
+    *p = src->chunks;
+
+    dst->used += src->used;
+    dst->reserved += src->reserved;
+    update_peak(dst);
+    src->chunks = NULL;
+    src->used = 0;
+    src->reserved = 0;
+}
+
+// Growable arrays. An array has a chunk of its own, which mremap() can
+// enlarge without copying, so the array may move while it grows. Once
+// complete, it is given to an arena by arena_adopt().
+
+// Returns an array of at least size bytes holding the contents of p,
+// which is NULL or an array returned earlier.
+void *array_grow(void *p, size_t size) {
+    size_t chunk_size = (size + HEADER_SIZE + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    if (!p)
+        return (char *)new_chunk(chunk_size) + HEADER_SIZE;
+
+    ArenaChunk *chunk = (ArenaChunk *)((char *)p - HEADER_SIZE);
+    if (chunk_size <= chunk->size)
+        return p;
+
+    chunk = mremap(chunk, chunk->size, chunk_size, MREMAP_MAYMOVE);
+    if (chunk == MAP_FAILED)
+        error("out of memory: %s", strerror(errno));
+    chunk->size = chunk_size;
+    chunk->end = (char *)chunk + chunk_size;
+    return (char *)chunk + HEADER_SIZE;
+}
+
+// Makes the array p, of which used bytes are in use, part of arena.
+void arena_adopt(Arena *arena, void *p, size_t used) {
+    ArenaChunk *chunk = (ArenaChunk *)((char *)p - HEADER_SIZE);
+    chunk->cur = (char *)p + (used + ALIGN - 1) / ALIGN * ALIGN;
+
+    // Behind the current chunk, so that arena keeps bumping in it.
+    ArenaChunk **q = arena->chunks ? &arena->chunks->next : &arena->chunks;
+    chunk->next = *q;
+    *q = chunk;
+
+    arena->used += used;
+    arena->reserved += chunk->size;
+    update_peak(arena);
+}
+
+static void free_chunk_list(ArenaChunk *chunk, bool keep) {
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        if (keep && chunk->size == CHUNK_SIZE) {
+            char *start = (char *)chunk + HEADER_SIZE;
+            memset(start, 0, chunk->cur - start);
+            chunk->next = free_chunks;
+            free_chunks = chunk;
+        } else {
+            munmap(chunk, chunk->size);
+        }
+        chunk = next;
+    }
+}
+
+// Frees every object allocated from a given arena at once.
+void arena_release(Arena *arena) {
+    free_chunk_list(arena->chunks, true);
+    arena->chunks = NULL;
+    arena->reserved = 0;
+}
+
+// Frees everything the current thread has compiled, returning the
+// memory to the OS. Types are freed by release_types() because of the
+// built-in types' caches.
+void arena_release_all(void) {
+    release_types();
+
+    Arena *arenas[] = {&token_arena, &list_arena, &node_arena, &global_arena};
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++) {
+        free_chunk_list(arenas[i]->chunks, false);
+        arenas[i]->chunks = NULL;
+        arenas[i]->reserved = 0;
+    }
+    free_chunk_list(free_chunks, false);
+    free_chunks = NULL;
+}
+
+void print_arena_stats(FILE *out) {
+    Arena *arenas[] = {&token_arena, &list_arena, &node_arena, &type_arena, &global_arena};
+
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++)
+        fprintf(out, "%s arena: %zu bytes used, %zu bytes peak reserved\n",
+                arenas[i]->name, arenas[i]->used, arenas[i]->peak);
+}
@@ -0,0 +1,293 @@
+// Content-addressed cache of compiled assembly. "--cache <dir>" keys
+// each compilation by a hash of the compiler binary, the flags that
+// change the output, the directories searched by #include and the input
+// bytes, and stores the assembly in <dir>. An unchanged input is then a
+// hash plus one file copy.
+//
+// An entry is a 32-byte header holding the time the compilation took and
+// the length of the list of included files, then that list, one
+// "<digest> <path>" line per file, then the assembly. An entry is used
+// only if the included files are unchanged. Entries are written to a
+// temporary file and
+// renamed into place, so a reader never sees a partial entry, even with
+// several compilers sharing the directory. Reading an entry updates its
+// mtime, and the least recently used entries are removed when the
+// directory grows beyond its size limit.
+#include "9cc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEADER_SIZE 32
+
+char *opt_cache;
+size_t opt_cache_size = 256 * 1024 * 1024;
+
+static atomic_int hits;
+static atomic_int misses;
+static atomic_llong saved_ns;
+
+static pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 128-bit FNV-1a
+typedef unsigned __int128 uint128_t;
+
+#define FNV128_PRIME (((uint128_t)0x1000000 << 64) | 0x13b)
+#define FNV128_BASIS (((uint128_t)0x6c62272e07bb0142 << 64) | 0x62b821756295c58d)
+
+static uint128_t fnv128(uint128_t hash, void *buf, size_t len) {
+    unsigned char *p = buf;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV128_PRIME;
+    }
+    return hash;
+}
+
+static struct stat exe;
+static pthread_once_t exe_once = PTHREAD_ONCE_INIT;
+
+static void stat_exe(void) {
+    stat("/proc/self/exe", &exe);
+}
+
+// A rebuilt compiler has a different size or mtime, so hashes that
+// start from this one do not match those of an older compiler.
+static uint128_t compiler_hash(void) {
+    pthread_once(&exe_once, stat_exe);
+
+    uint128_t hash = FNV128_BASIS;
+    hash = fnv128(hash, &exe.st_size, sizeof(exe.st_size));
+    hash = fnv128(hash, &exe.st_mtim, sizeof(exe.st_mtim));
+    return hash;
+}
+
+static char *hex(uint128_t hash) {
+    return format("%016llx%016llx", (unsigned long long)(hash >> 64),
+                  (unsigned long long)hash);
+}
+
+// Returns a hex digest of len bytes at p.
+char *digest(void *p, size_t len) {
+    return hex(fnv128(FNV128_BASIS, p, len));
+}
+
+// Returns a hex digest that identifies this build of the compiler.
+char *compiler_digest(void) {
+    return hex(compiler_hash());
+}
+
+// Returns the name of the cache entry for input p, the contents of
+// path. Which headers #include finds depends on the directory of path
+// and on the include paths in order, and on the working directory if
+// any of them is relative, so these are part of the key as well.
+char *cache_key(char *path, char *p, bool stream) {
+    uint128_t hash = compiler_hash();
+    hash = fnv128(hash, &stream, sizeof(stream));
+
+    char *slash = strrchr(path, '/');
+    hash = fnv128(hash, path, slash ? slash - path + 1 : 0);
+    hash = fnv128(hash, "", 1);
+    bool relative = path[0] != '/';
+
+    int n;
+    char **dirs = get_include_paths(&n);
+    for (int i = 0; i < n; i++) {
+        hash = fnv128(hash, dirs[i], strlen(dirs[i]) + 1);
+        relative |= dirs[i][0] != '/';
+    }
+
+    if (relative) {
+        char *cwd = getcwd(NULL, 0);
+        if (!cwd)
+            error("getcwd: %s", strerror(errno));
+        hash = fnv128(hash, cwd, strlen(cwd) + 1);
+        free(cwd);
+    }
+
+    hash = fnv128(hash, p, strlen(p));
+
+    char *name = hex(hash);
+    char *key = format("%s/%s.s", opt_cache, name);
+    free(name);
+    return key;
+}
+
+// Returns true if the file at path has a given digest.
+bool file_matches(char *path, char *expected) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    char *buf;
+    size_t len;
+    FILE *out = open_memstream(&buf, &len);
+    char buf2[4096];
+    for (int n; (n = fread(buf2, 1, sizeof(buf2), fp)) > 0;)
+        fwrite(buf2, 1, n, out);
+    fclose(out);
+    fclose(fp);
+
+    char *d = digest(buf, len);
+    bool ok = !strcmp(d, expected);
+    free(d);
+    free(buf);
+    return ok;
+}
+
+// Returns true if none of the files in a list of "<digest> <path>"
+// lines has changed.
+static bool deps_unchanged(char *deps) {
+    for (char *line = deps; *line;) {
+        char *nl = strchr(line, '\n');
+        char *sp = strchr(line, ' ');
+        if (!nl || !sp || sp > nl)
+            return false;
+        *sp = *nl = '\0';
+        if (!file_matches(sp + 1, line))
+            return false;
+        line = nl + 1;
+    }
+    return true;
+}
+
+// Returns the cached assembly for a given key and sets its length to
+// *len, or returns NULL if there is no such entry.
+char *cache_load(char *key, size_t *len) {
+    long long start = now_ns();
+
+    int fd = open(key, O_RDONLY);
+    if (fd < 0) {
+        misses++;
+        return NULL;
+    }
+
+    struct stat st;
+    char header[HEADER_SIZE + 1] = {};
+    char *buf = NULL;
+    size_t deps_len = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= HEADER_SIZE &&
+        read(fd, header, HEADER_SIZE) == HEADER_SIZE &&
+        (deps_len = strtoull(header + HEADER_SIZE / 2, NULL, 16)) <= st.st_size - HEADER_SIZE) {
+        char *deps = calloc(1, deps_len + 1);
+        *len = st.st_size - HEADER_SIZE - deps_len;
+        buf = malloc(*len);
+        if (read(fd, deps, deps_len) != deps_len || !deps_unchanged(deps) ||
+            read(fd, buf, *len) != *len) {
+            free(buf);
+            buf = NULL;
+        }
+        free(deps);
+    }
+
+    if (!buf) {
+        close(fd);
+        misses++;
+        return NULL;
+    }
+
+    // Mark the entry as recently used.
+    futimens(fd, NULL);
+    close(fd);
+
+    hits++;
+    saved_ns += strtoll(header, NULL, 16) - (now_ns() - start);
+    return buf;
+}
+
+typedef struct {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+} Entry;
+
+static int cmp_mtime(const void *x, const void *y) {
+    const Entry *a = x;
+    const Entry *b = y;
+    if (a->mtime.tv_sec != b->mtime.tv_sec)
+        return a->mtime.tv_sec < b->mtime.tv_sec ? -1 : 1;
+    if (a->mtime.tv_nsec != b->mtime.tv_nsec)
+        return a->mtime.tv_nsec < b->mtime.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Removes the least recently used entries until the cache fits in
+// opt_cache_size bytes.
+static void evict(void) {
+    DIR *dir = opendir(opt_cache);
+    if (!dir)
+        return;
+
+    Entry *entries = NULL;
+    int n = 0;
+    off_t total = 0;
+
+    for (struct dirent *ent; (ent = readdir(dir));) {
+        int len = strlen(ent->d_name);
+        if (len < 2 || strcmp(ent->d_name + len - 2, ".s"))
+            continue;
+
+        char *path = format("%s/%s", opt_cache, ent->d_name);
+        struct stat st;
+        if (stat(path, &st)) {
+            free(path);
+            continue;
+        }
+
+        entries = realloc(entries, sizeof(Entry) * (n + 1));
+        entries[n++] = (Entry){path, st.st_size, st.st_mtim};
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    if (total > opt_cache_size) {
+        qsort(entries, n, sizeof(Entry), cmp_mtime);
+        for (int i = 0; i < n && total > opt_cache_size; i++)
+            if (unlink(entries[i].path) == 0)
+                total -= entries[i].size;
+    }
+
+    for (int i = 0; i < n; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+// Stores the assembly for a given key. elapsed_ns is how long the
+// compilation took, and deps lists the files it included, as returned
+// by preprocess_deps(). Failing to write the cache is not an error.
+void cache_store(char *key, char *buf, size_t len, long long elapsed_ns, char *deps) {
+    mkdir(opt_cache, 0777);
+
+    char *tmp = format("%s/tmp-%d-%lx", opt_cache, getpid(), (unsigned long)pthread_self());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        free(tmp);
+        return;
+    }
+
+    fprintf(fp, "%015llx\n%015zx\n%s", elapsed_ns, strlen(deps), deps);
+    fwrite(buf, 1, len, fp);
+    if (fclose(fp) == 0 && rename(tmp, key) == 0) {
+        pthread_mutex_lock(&evict_lock);
+        evict();
+        pthread_mutex_unlock(&evict_lock);
+    } else {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+void print_cache_stats(FILE *out) {
+    fprintf(out, "cache: %d hits, %d misses, %.3f ms saved\n",
+            (int)hits, (int)misses, saved_ns / 1e6);
+}
@@ -1,34 +1,212 @@
 #include "9cc.h"
+#include <elf.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+// Code generation state is per thread so that functions can be
+// generated concurrently (see codegen_parallel()).
+static _Thread_local FILE *output_file;
+static _Thread_local int depth;
+static _Thread_local Obj *current_fn;
+static _Thread_local int label_count;
+
+// Assembly is formatted by hand into out_buf and written to output_file
+// in large blocks by flush(). Without an output file the buffer just
+// grows, and is handed over by codegen_function_buf().
+static _Thread_local char *out_buf;
+static _Thread_local size_t out_len;
+static _Thread_local size_t out_cap;
+
+#define FLUSH_SIZE (256 * 1024)
+
+// With -c, instructions are encoded and handed to elf.c instead.
+static _Thread_local bool as_object;
 
-static FILE *output_file;
-static int depth;
 static char *argreg8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
 static char *argreg64[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-static Obj *current_fn;
+static char *pop_argreg[] = {
+    "  pop rdi\n", "  pop rsi\n", "  pop rdx\n", "  pop rcx\n", "  pop r8\n", "  pop r9\n",
+};
+
+// Encodings of "pop <reg>" and of the part of "mov [rbp + <disp32>], <reg>"
+// before the displacement, for each argument register
+static char *pop_argreg_code[] = {"\x5f", "\x5e", "\x5a", "\x59", "\x41\x58", "\x41\x59"};
+static char *store_argreg8_code[] = {
+    "\x40\x88\xbd", "\x40\x88\xb5", "\x88\x95", "\x88\x8d", "\x44\x88\x85", "\x44\x88\x8d",
+};
+static char *store_argreg64_code[] = {
+    "\x48\x89\xbd", "\x48\x89\xb5", "\x48\x89\x95", "\x48\x89\x8d", "\x4c\x89\x85", "\x4c\x89\x8d",
+};
+
+// Local labels of a function. With -c, label n of a kind is number
+// n * 4 + kind.
+enum { L_BEGIN, L_ELSE, L_END, L_RETURN };
+static char *label_names[] = {"begin", "else", "end", "return"};
 
 static void gen_expr(Node *node);
 static void gen_stmt(Node *node);
 
+// Writes out the buffered assembly.
+static void flush(void) {
+    if (!output_file || out_len == 0)
+        return;
+
+    // Text written to the stream by others has to come first.
+    int fd = fileno(output_file);
+    if (fd < 0 || fflush(output_file)) {
+        fwrite(out_buf, 1, out_len, output_file);
+        out_len = 0;
+        return;
+    }
+
+    for (char *p = out_buf; p < out_buf + out_len;) {
+        ssize_t n = write(fd, p, out_buf + out_len - p);
+        if (n < 0 && errno != EINTR)
+            error("cannot write output: %s", strerror(errno));
+        if (n > 0)
+            p += n;
+    }
+    out_len = 0;
+}
+
+// Returns room for n more bytes at the end of the buffer.
+static char *reserve(size_t n) {
+    if (out_len + n <= out_cap)
+        return out_buf + out_len;
+
+    if (output_file)
+        flush();
+    if (out_len + n > out_cap) {
+        out_cap = out_cap ? out_cap * 2 : FLUSH_SIZE;
+        if (out_cap < out_len + n)
+            out_cap = out_len + n;
+        out_buf = realloc(out_buf, out_cap);
+    }
+    return out_buf + out_len;
+}
+
+static void emit(char *s, size_t len) {
+    memcpy(reserve(len), s, len);
+    out_len += len;
+}
+
+static void emit_str(char *s) {
+    emit(s, strlen(s));
+}
+
+static void emit_int(int val) {
+    char tmp[12];
+    char *p = tmp + sizeof(tmp);
+    unsigned v = val < 0 ? -(unsigned)val : val;
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (val < 0)
+        *--p = '-';
+    emit(p, tmp + sizeof(tmp) - p);
+}
+
+// Emits an instruction with no operands to format, given as text and
+// as machine code. The newline is added at compile time.
+#define insn(s, code) \
+    (as_object ? elf_bytes(code, sizeof(code) - 1) : emit(s "\n", sizeof(s)))
+
+// Emits s followed by a 32-bit operand, as in "  mov rax, 42"; code is
+// the encoding up to the operand.
+#define insn_int(s, code, val) emit_int_line(s, sizeof(s) - 1, code, sizeof(code) - 1, val)
+
+static void emit_int_line(char *s, size_t len, char *code, size_t code_len, int val) {
+    if (as_object) {
+        elf_bytes(code, code_len);
+        elf_bytes(&val, 4);
+        return;
+    }
+    emit(s, len);
+    emit_int(val);
+    emit("\n", 1);
+}
+
+// Emits an instruction with an [rbp + disp] operand; code is its
+// encoding up to the displacement, with a ModRM byte for a 32-bit one.
+// A displacement that fits in 8 bits gets the shorter form.
+static void emit_rbp_insn(char *code, int disp) {
+    int len = strlen(code);
+    if (disp < -128 || 127 < disp) {
+        emit_int_line(NULL, 0, code, len, disp);
+        return;
+    }
+    char buf[8];
+    memcpy(buf, code, len);
+    buf[len - 1] -= 0x40;
+    buf[len] = disp;
+    elf_bytes(buf, len + 1);
+}
+
+// Emits a line. Only %d and %s are supported, which is all that the
+// code generator needs.
 static void println(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(output_file, fmt, ap);
+
+    char *start = fmt;
+    for (char *p = fmt; *p; p++) {
+        if (*p != '%')
+            continue;
+        emit(start, p - start);
+        p++;
+        if (*p == 'd')
+            emit_int(va_arg(ap, int));
+        else if (*p == 's')
+            emit_str(va_arg(ap, char *));
+        else
+            unreachable();
+        start = p + 1;
+    }
+    emit(start, strlen(start));
+    emit("\n", 1);
     va_end(ap);
-    fprintf(output_file, "\n");
 }
 
+// Returns a new label number. Numbers restart for each function and
+// labels carry the function name, so a function's code does not depend
+// on which functions were generated before it.
 static int count(void) {
-    static int i = 1;
-    return i++;
+    return ++label_count;
+}
+
+// Defines label c of a kind; L_RETURN has no number.
+static void label(int kind, int c) {
+    if (as_object)
+        elf_label(c * 4 + kind);
+    else if (kind == L_RETURN)
+        println(".L.%s.%s:", label_names[kind], current_fn->name);
+    else
+        println(".L.%s.%s.%d:", label_names[kind], current_fn->name, c);
+}
+
+// Emits "jmp" or, if cond, "je" to label c of a kind.
+static void jump(bool cond, int kind, int c) {
+    char *op = cond ? "je" : "jmp";
+    if (as_object)
+        elf_jump(cond, c * 4 + kind);
+    else if (kind == L_RETURN)
+        println("  %s .L.%s.%s", op, label_names[kind], current_fn->name);
+    else
+        println("  %s .L.%s.%s.%d", op, label_names[kind], current_fn->name, c);
 }
 
 static void push(void) {
-    println("  push rax");
+    insn("  push rax", "\x50");
     depth++;
 }
 
-static void pop(char *arg) {
-    println("  pop %s", arg);
+static void pop(int reg) {
+    if (as_object)
+        elf_bytes(pop_argreg_code[reg], strlen(pop_argreg_code[reg]));
+    else
+        emit_str(pop_argreg[reg]);
     depth--;
 }
 
@@ -41,10 +219,19 @@ static void gen_addr(Node *node) {
     case ND_VAR:
         if (node->var->is_local) {
             // Local variable
-            println("  lea rax, [rbp + %d]", node->var->offset);
+            if (as_object)
+                emit_rbp_insn("\x48\x8d\x85", node->var->offset);
+            else
+                println("  lea rax, [rbp + %d]", node->var->offset);
         } else {
             // Global variable
-            println("  lea rax, %s[rip]", node->var->name);
+            if (as_object) {
+                elf_bytes("\x48\x8d\x05", 3);
+                elf_reloc(node->var->name, R_X86_64_PC32, -4);
+                elf_zero(4);
+            } else {
+                println("  lea rax, %s[rip]", node->var->name);
+            }
         }
         return;
     case ND_DEREF:
@@ -61,29 +248,29 @@ static void load(Type *ty) {
         return;
     }
     if (ty->size == 1)
-        println("  movsx eax, BYTE PTR [rax]");
+        insn("  movsx eax, BYTE PTR [rax]", "\x0f\xbe\x00");
     else
-        println("  mov rax, [rax]");
+        insn("  mov rax, [rax]", "\x48\x8b\x00");
 }
 
 // Store rax to an address that the stack top is pointing to.
 static void store(Type *ty) {
-    pop("rdi");
+    pop(0);
 
     if (ty->size == 1)
-        println("  mov [rdi], al");
+        insn("  mov [rdi], al", "\x88\x07");
     else
-        println("  mov [rdi], rax");
+        insn("  mov [rdi], rax", "\x48\x89\x07");
 }
 
 static void gen_expr(Node *node) {
     switch (node->kind) {
     case ND_NUM:
-        println("  mov rax, %d", node->val);
+        insn_int("  mov rax, ", "\x48\xc7\xc0", node->val);
         return;
     case ND_NEG:
         gen_expr(node->lhs);
-        println("  neg rax");
+        insn("  neg rax", "\x48\xf7\xd8");
         return;
     case ND_VAR:
         gen_addr(node);
@@ -115,10 +302,16 @@ static void gen_expr(Node *node) {
         }
 
         for (int i = nargs - 1; i >= 0; i--)
-            pop(argreg64[i]);
+            pop(i);
         
-        println("  mov rax, %d", nargs);
-        println("  call %s", node->funcname);
+        insn_int("  mov rax, ", "\x48\xc7\xc0", nargs);
+        if (as_object) {
+            elf_bytes("\xe8", 1);
+            elf_reloc(node->funcname, R_X86_64_PLT32, -4);
+            elf_zero(4);
+        } else {
+            println("  call %s", node->funcname);
+        }
         return;
     }
     }
@@ -126,36 +319,36 @@ static void gen_expr(Node *node) {
     gen_expr(node->rhs);
     push();
     gen_expr(node->lhs);
-    pop("rdi");
+    pop(0);
 
     switch (node->kind) {
     case ND_ADD:
-        println("  add rax, rdi");
+        insn("  add rax, rdi", "\x48\x01\xf8");
         return;
     case ND_SUB:
-        println("  sub rax, rdi");
+        insn("  sub rax, rdi", "\x48\x29\xf8");
         return;
     case ND_MUL:
-        println("  imul rax, rdi");
+        insn("  imul rax, rdi", "\x48\x0f\xaf\xc7");
         return;
     case ND_DIV:
-        println("  cqo");
-        println("  idiv rdi");
+        insn("  cqo", "\x48\x99");
+        insn("  idiv rdi", "\x48\xf7\xff");
         return;
     case ND_EQ:
     case ND_NE:
     case ND_LT:
     case ND_LE:
-        println("  cmp rax, rdi");
+        insn("  cmp rax, rdi", "\x48\x39\xf8");
         if (node->kind == ND_EQ)
-            println("  sete al");
+            insn("  sete al", "\x0f\x94\xc0");
         else if (node->kind == ND_NE)
-            println("  setne al");
+            insn("  setne al", "\x0f\x95\xc0");
         else if (node->kind == ND_LT)
-            println("  setl al");
+            insn("  setl al", "\x0f\x9c\xc0");
         else if (node->kind == ND_LE)
-            println("  setle al");
-        println("  movzb rax, al");
+            insn("  setle al", "\x0f\x9e\xc0");
+        insn("  movzb rax, al", "\x48\x0f\xb6\xc0");
         return;
     }
 
@@ -167,31 +360,31 @@ static void gen_stmt(Node *node) {
     case ND_IF: {
         int c = count();
         gen_expr(node->cond);
-        println("  cmp rax, 0");
-        println("  je .L.else.%d", c);
+        insn("  cmp rax, 0", "\x48\x83\xf8\x00");
+        jump(true, L_ELSE, c);
         gen_stmt(node->then);
-        println("  jmp .L.end.%d", c);
-        println(".L.else.%d:", c);
+        jump(false, L_END, c);
+        label(L_ELSE, c);
         if (node->els)
             gen_stmt(node->els);
-        println(".L.end.%d:", c);
+        label(L_END, c);
         return;
     }
     case ND_FOR: {
         int c = count();
         if (node->init)
             gen_stmt(node->init);
-        println(".L.begin.%d:", c);
+        label(L_BEGIN, c);
         if (node->cond) {
             gen_expr(node->cond);
-            println("  cmp rax, 0");
-            println("  je .L.end.%d", c);
+            insn("  cmp rax, 0", "\x48\x83\xf8\x00");
+            jump(true, L_END, c);
         }
         gen_stmt(node->then);
         if (node->inc)
             gen_expr(node->inc);
-        println("  jmp .L.begin.%d", c);
-        println(".L.end.%d:", c);
+        jump(false, L_BEGIN, c);
+        label(L_END, c);
         return;
     }
     case ND_BLOCK:
@@ -200,7 +393,7 @@ static void gen_stmt(Node *node) {
         return;
     case ND_RETURN:
         gen_expr(node->lhs);
-        println("  jmp .L.return.%s", current_fn->name);
+        jump(false, L_RETURN, 0);
         return;
     case ND_EXPR_STMT:
         gen_expr(node->lhs);
@@ -210,78 +403,220 @@ static void gen_stmt(Node *node) {
     error_tok(node->tok, "invalud statement");
 }
 
-static void assign_lvar_offsets(Obj *prog) {
-    for (Obj *fn = prog; fn; fn = fn->next) {
-        if (!fn->is_function)
-            continue;
-
-        int offset = 0;
-        for (Obj *var = fn->locals; var; var = var->next) {
-            offset += var->ty->size;
-            var->offset = -offset;
-        }
-        fn->stack_size = align_to(offset, 16);   
+static void assign_lvar_offsets(Obj *fn) {
+    int offset = 0;
+    for (Obj *var = fn->locals; var; var = var->next) {
+        offset += var->ty->size;
+        var->offset = -offset;
     }
+    fn->stack_size = align_to(offset, 16);
 }
 
-static void emit_data(Obj *prog) {
-    for (Obj *var = prog; var; var = var->next) {
-        if (var->is_function)
-            continue;
+// Emits global variables and string literals.
+static void emit_data(Obj *var) {
+    if (as_object) {
+        elf_section(false);
+        elf_symbol(var->name);
+        if (var->init_data)
+            elf_bytes(var->init_data, var->ty->size);
+        else
+            elf_zero(var->ty->size);
+        return;
+    }
 
-        println("  .data");
-        println("  .globl %s", var->name);
-        println("%s:", var->name);
+    emit_str("  .data\n");
+    println("  .globl %s", var->name);
+    println("%s:", var->name);
 
-        if (var->init_data) {
-            for (int i = 0; i < var->ty->size; i++)
-                println("  .byte %d", var->init_data[i]);
-        } else {
-            println("  .zero %d", var->ty->size);
-        }
+    if (var->init_data) {
+        for (int i = 0; i < var->ty->size; i++)
+            insn_int("  .byte ", "", var->init_data[i]);
+    } else {
+        insn_int("  .zero ", "", var->ty->size);
     }
 }
 
-static void emit_text(Obj *prog) {
-    for (Obj *fn = prog; fn; fn = fn->next) {
-        if (!fn->is_function)
-            continue;
+void codegen_data(Obj *prog) {
+    for (Obj *var = prog; var; var = var->next)
+        if (!var->is_function)
+            emit_data(var);
+}
 
+// Emits a function together with its string literals, so that the
+// output for a function depends only on that function.
+void codegen_function(Obj *fn) {
+    assign_lvar_offsets(fn);
+
+    for (Obj *var = fn->literals; var; var = var->next)
+        emit_data(var);
+
+    if (as_object) {
+        elf_section(true);
+        elf_symbol(fn->name);
+    } else {
         println("  .globl %s", fn->name);
-        println("  .text");
+        emit_str("  .text\n");
         println("%s:", fn->name);
-        current_fn = fn;
-        
-        // Prologue
-        println("  push rbp");
-        println("  mov rbp, rsp");
-        println("  sub rsp, %d", fn->stack_size);
-        
-        int i = 0;
-        for (Obj *var = fn->params; var; var = var->next) {
-            if (var->ty->size == 1)
-                println("  mov [rbp + %d], %s", var->offset, argreg8[i++]);
-            else
-                println("  mov [rbp + %d], %s", var->offset, argreg64[i++]);
-        }
+    }
+    current_fn = fn;
+    label_count = 0;
+    depth = 0;
+    
+    // Prologue
+    insn("  push rbp", "\x55");
+    insn("  mov rbp, rsp", "\x48\x89\xe5");
+    if (as_object && fn->stack_size < 128)
+        elf_bytes((char[]){0x48, 0x83, 0xec, fn->stack_size}, 4);
+    else
+        insn_int("  sub rsp, ", "\x48\x81\xec", fn->stack_size);
+    
+    int i = 0;
+    for (Obj *var = fn->params; var; var = var->next) {
+        char **code = var->ty->size == 1 ? store_argreg8_code : store_argreg64_code;
+        if (as_object)
+            emit_rbp_insn(code[i], var->offset);
+        else if (var->ty->size == 1)
+            println("  mov [rbp + %d], %s", var->offset, argreg8[i]);
+        else
+            println("  mov [rbp + %d], %s", var->offset, argreg64[i]);
+        i++;
+    }
 
-        gen_stmt(fn->body);
-        assert(depth == 0);
+    gen_stmt(fn->body);
+    assert(depth == 0);
 
-        // Epilogue
-        println(".L.return.%s:", fn->name);
-        println("  mov rsp, rbp");
-        println("  pop rbp");
-        println("  ret");
+    // Epilogue
+    label(L_RETURN, 0);
+    insn("  mov rsp, rbp", "\x48\x89\xec");
+    insn("  pop rbp", "\x5d");
+    insn("  ret", "\xc3");
+
+    if (as_object)
+        elf_function_end();
+}
+
+// Generates a function into a buffer of its own and returns it.
+char *codegen_function_buf(Obj *fn, size_t *len) {
+    FILE *out = output_file;
+    char *buf = out_buf;
+    size_t buf_len = out_len;
+    size_t buf_cap = out_cap;
+
+    output_file = NULL;
+    out_buf = NULL;
+    out_len = out_cap = 0;
+    codegen_function(fn);
+
+    char *ret = out_buf;
+    *len = out_len;
+    output_file = out;
+    out_buf = buf;
+    out_len = buf_len;
+    out_cap = buf_cap;
+    return ret;
+}
+
+// Emits assembly that was generated earlier, such as the result of
+// codegen_function_buf().
+void codegen_text(char *text, size_t len) {
+    emit(text, len);
+}
+
+void codegen_begin(FILE *out) {
+    output_file = out;
+    out_len = 0;
+    emit_str(".intel_syntax noprefix\n");
+}
+
+// Writes out what is left in the buffer. Nothing else may be written
+// to the output between codegen_begin() and codegen_end().
+void codegen_end(void) {
+    flush();
+}
+
+// Functions to be generated by worker threads. Each worker repeatedly
+// claims the next unclaimed function, so a thread that finishes early
+// simply takes more of the remaining ones.
+typedef struct {
+    Obj **fns;
+    int nfns;
+    atomic_int next;
+    char **bufs;
+    size_t *lens;
+} CodegenJobs;
+
+static void *codegen_worker(void *arg) {
+    CodegenJobs *jobs = arg;
+
+    for (;;) {
+        int i = atomic_fetch_add(&jobs->next, 1);
+        if (i >= jobs->nfns)
+            return NULL;
+
+        jobs->bufs[i] = codegen_function_buf(jobs->fns[i], &jobs->lens[i]);
     }
 }
 
+// Generates each function into its own buffer on opt_jobs threads and
+// writes the buffers in list order, so that the output is the same as
+// generating them one by one.
+static void codegen_parallel(Obj *prog) {
+    CodegenJobs jobs = {};
+    for (Obj *fn = prog; fn; fn = fn->next)
+        if (fn->is_function)
+            jobs.nfns++;
+
+    jobs.fns = calloc(jobs.nfns, sizeof(Obj *));
+    jobs.bufs = calloc(jobs.nfns, sizeof(char *));
+    jobs.lens = calloc(jobs.nfns, sizeof(size_t));
+
+    int i = 0;
+    for (Obj *fn = prog; fn; fn = fn->next)
+        if (fn->is_function)
+            jobs.fns[i++] = fn;
+
+    int nthreads = opt_jobs < jobs.nfns ? opt_jobs : jobs.nfns;
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, codegen_worker, &jobs))
+            error("cannot create a thread");
+    codegen_worker(&jobs);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < jobs.nfns; i++) {
+        emit(jobs.bufs[i], jobs.lens[i]);
+        free(jobs.bufs[i]);
+    }
+
+    free(threads);
+    free(jobs.fns);
+    free(jobs.bufs);
+    free(jobs.lens);
+}
+
 void codegen(Obj *prog, FILE *out) {
-    output_file = out;
-    assign_lvar_offsets(prog);
+    codegen_begin(out);
+    codegen_data(prog);
 
-    println(".intel_syntax noprefix");
+    if (opt_jobs > 1) {
+        codegen_parallel(prog);
+    } else {
+        for (Obj *fn = prog; fn; fn = fn->next)
+            if (fn->is_function)
+                codegen_function(fn);
+    }
+    codegen_end();
+}
 
-    emit_data(prog);
-    emit_text(prog);
+// Writes prog to out as an ELF relocatable object.
+void codegen_object(Obj *prog, FILE *out) {
+    as_object = true;
+    elf_begin();
+    codegen_data(prog);
+    for (Obj *fn = prog; fn; fn = fn->next)
+        if (fn->is_function)
+            codegen_function(fn);
+    elf_write(out);
+    as_object = false;
 }
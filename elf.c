@@ -0,0 +1,384 @@
+// ELF64 relocatable object output for -c. codegen.c encodes each
+// instruction itself and hands the bytes over together with symbols,
+// relocations and local labels; this file lays out the sections and
+// writes the object file.
+//
+// The code of a function is collected without its jumps to local
+// labels. When the function is complete, each jump is made as short as
+// its displacement allows: all jumps start out with an 8-bit
+// displacement, and a jump whose target is out of reach is widened to a
+// 32-bit one until nothing changes. Widening only moves targets further
+// away, so this terminates.
+#include "9cc.h"
+#include <elf.h>
+
+typedef struct {
+    char *name;
+    int shndx;       // SHN_UNDEF if only referenced
+    uint64_t value;
+    bool global;
+    int type;
+    int index;       // index in .symtab
+} Symbol;
+
+// A position in the code of the current function: an offset in the
+// code without jumps, and the number of jumps that come before it.
+typedef struct {
+    int raw;
+    int njumps;
+} Pos;
+
+typedef struct {
+    uint64_t offset;
+    Pos pos;         // position while the function is incomplete
+    Symbol *sym;
+    int type;
+    int64_t addend;
+} Reloc;
+
+typedef struct {
+    Pos pos;
+    bool cond;       // je rather than jmp
+    int label;
+    bool near;       // has a 32-bit displacement
+} Jump;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+static _Thread_local Buffer text;
+static _Thread_local Buffer data;
+static _Thread_local Buffer *section;
+
+static _Thread_local Symbol **syms;
+static _Thread_local int nsyms, syms_cap;
+static _Thread_local HashMap sym_map;
+
+static _Thread_local Reloc *relocs;
+static _Thread_local int nrelocs, relocs_cap;
+
+// The current function
+static _Thread_local Buffer code;
+static _Thread_local Jump *jumps;
+static _Thread_local int njumps, jumps_cap;
+static _Thread_local Pos *labels;
+static _Thread_local int nlabels, labels_cap;
+static _Thread_local Reloc *fn_relocs;
+static _Thread_local int nfn_relocs, fn_relocs_cap;
+
+// Makes room for element n of an array.
+static void *grow(void *p, int n, int *cap, int size) {
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 16;
+    return realloc(p, *cap * size);
+}
+
+// Appends len bytes from p, or len zero bytes if p is NULL.
+static void append(Buffer *b, void *p, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 4096;
+        if (b->cap < b->len + len)
+            b->cap = b->len + len;
+        b->buf = realloc(b->buf, b->cap);
+    }
+    if (p)
+        memcpy(b->buf + b->len, p, len);
+    else
+        memset(b->buf + b->len, 0, len);
+    b->len += len;
+}
+
+static Symbol *get_symbol(char *name) {
+    Symbol *sym = hashmap_get(&sym_map, name);
+    if (sym)
+        return sym;
+
+    sym = calloc(1, sizeof(Symbol));
+    sym->name = name;
+    sym->global = true;
+    syms = grow(syms, nsyms, &syms_cap, sizeof(Symbol *));
+    syms[nsyms++] = sym;
+    hashmap_put(&sym_map, name, sym);
+    return sym;
+}
+
+static Pos current_pos(void) {
+    return (Pos){code.len, njumps};
+}
+
+void elf_begin(void) {
+    section = &data;
+}
+
+// Switches to .text or .data.
+void elf_section(bool is_text) {
+    section = is_text ? &code : &data;
+}
+
+void elf_bytes(void *p, size_t len) {
+    append(section, p, len);
+}
+
+void elf_zero(size_t len) {
+    append(section, NULL, len);
+}
+
+// Defines name at the current position. Names starting with ".L" are
+// local to the object.
+void elf_symbol(char *name) {
+    Symbol *sym = get_symbol(name);
+    if (sym->shndx != SHN_UNDEF)
+        error("%s: defined twice", name);
+
+    if (section == &code) {
+        sym->shndx = 1;
+        sym->value = text.len;
+        sym->type = STT_FUNC;
+    } else {
+        sym->shndx = 2;
+        sym->value = data.len;
+        sym->type = STT_OBJECT;
+    }
+    sym->global = strncmp(name, ".L", 2);
+}
+
+// Adds a relocation of the given type for the 4 bytes that are about to
+// be emitted.
+void elf_reloc(char *name, int type, int64_t addend) {
+    fn_relocs = grow(fn_relocs, nfn_relocs, &fn_relocs_cap, sizeof(Reloc));
+    fn_relocs[nfn_relocs++] = (Reloc){0, current_pos(), get_symbol(name), type, addend};
+}
+
+// Defines local label id of the current function here.
+void elf_label(int id) {
+    while (nlabels <= id) {
+        labels = grow(labels, nlabels, &labels_cap, sizeof(Pos));
+        labels[nlabels++] = (Pos){-1};
+    }
+    labels[id] = current_pos();
+}
+
+// Emits a jump, conditional on ZF if cond, to local label id.
+void elf_jump(bool cond, int id) {
+    jumps = grow(jumps, njumps, &jumps_cap, sizeof(Jump));
+    jumps[njumps] = (Jump){current_pos(), cond, id, false};
+    njumps++;
+}
+
+static int jump_size(Jump *j) {
+    if (!j->near)
+        return 2;
+    return j->cond ? 6 : 5;
+}
+
+// Returns the offset of pos in the laid-out function, given the offset
+// of each jump.
+static int64_t final_pos(Pos pos, int64_t *offsets) {
+    if (pos.njumps == 0)
+        return pos.raw;
+    Jump *j = &jumps[pos.njumps - 1];
+    return offsets[pos.njumps - 1] + jump_size(j) + pos.raw - j->pos.raw;
+}
+
+static void layout(int64_t *offsets) {
+    for (int i = 0; i < njumps; i++)
+        offsets[i] = final_pos(jumps[i].pos, offsets);
+}
+
+// Relaxes the jumps of the function and appends its code to .text.
+void elf_function_end(void) {
+    int64_t *offsets = calloc(njumps, sizeof(int64_t));
+
+    for (int i = 0; i < njumps; i++)
+        if (jumps[i].label >= nlabels || labels[jumps[i].label].raw < 0)
+            error("internal error: undefined label %d", jumps[i].label);
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        layout(offsets);
+        for (int i = 0; i < njumps; i++) {
+            Jump *j = &jumps[i];
+            int64_t disp = final_pos(labels[j->label], offsets) - (offsets[i] + jump_size(j));
+            if (!j->near && (disp < -128 || 127 < disp)) {
+                j->near = true;
+                changed = true;
+            }
+        }
+    }
+
+    int64_t base = text.len;
+    int raw = 0;
+    for (int i = 0; i < njumps; i++) {
+        Jump *j = &jumps[i];
+        append(&text, code.buf + raw, j->pos.raw - raw);
+        raw = j->pos.raw;
+
+        int32_t disp = final_pos(labels[j->label], offsets) - (offsets[i] + jump_size(j));
+        if (!j->near) {
+            uint8_t insn[] = {j->cond ? 0x74 : 0xeb, (uint8_t)disp};
+            append(&text, insn, sizeof(insn));
+        } else if (j->cond) {
+            append(&text, "\x0f\x84", 2);
+            append(&text, &disp, 4);
+        } else {
+            append(&text, "\xe9", 1);
+            append(&text, &disp, 4);
+        }
+    }
+    append(&text, code.buf + raw, code.len - raw);
+
+    for (int i = 0; i < nfn_relocs; i++) {
+        relocs = grow(relocs, nrelocs, &relocs_cap, sizeof(Reloc));
+        relocs[nrelocs] = fn_relocs[i];
+        relocs[nrelocs++].offset = base + final_pos(fn_relocs[i].pos, offsets);
+    }
+
+    free(offsets);
+    code.len = 0;
+    njumps = nlabels = nfn_relocs = 0;
+}
+
+static void pad(Buffer *b, int align) {
+    append(b, NULL, (align - b->len % align) % align);
+}
+
+enum {
+    SEC_TEXT = 1,
+    SEC_DATA,
+    SEC_RELA_TEXT,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_SHSTRTAB,
+    SEC_NOTE_STACK,
+    NSECTIONS,
+};
+
+// Writes the object file and frees everything.
+void elf_write(FILE *out) {
+    // Local symbols come first in .symtab.
+    Buffer strtab = {};
+    append(&strtab, "", 1);
+    Elf64_Sym *symtab = calloc(nsyms + 1, sizeof(Elf64_Sym));
+    int nlocals = 1;
+    int idx = 1;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < nsyms; i++) {
+            Symbol *sym = syms[i];
+            if (sym->global != (pass == 1))
+                continue;
+            Elf64_Sym *s = &symtab[idx];
+            s->st_name = strtab.len;
+            s->st_info = ELF64_ST_INFO(sym->global ? STB_GLOBAL : STB_LOCAL, sym->type);
+            s->st_shndx = sym->shndx;
+            s->st_value = sym->value;
+            sym->index = idx++;
+            append(&strtab, sym->name, strlen(sym->name) + 1);
+        }
+        if (pass == 0)
+            nlocals = idx;
+    }
+
+    Elf64_Rela *rela = calloc(nrelocs, sizeof(Elf64_Rela));
+    for (int i = 0; i < nrelocs; i++) {
+        rela[i].r_offset = relocs[i].offset;
+        rela[i].r_info = ELF64_R_INFO(relocs[i].sym->index, relocs[i].type);
+        rela[i].r_addend = relocs[i].addend;
+    }
+
+    struct {
+        char *name;
+        int type;
+        int flags;
+        void *p;
+        size_t len;
+        int align;
+    } contents[NSECTIONS] = {
+        [SEC_TEXT] = {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, text.buf, text.len, 16},
+        [SEC_DATA] = {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, data.buf, data.len, 1},
+        [SEC_RELA_TEXT] = {".rela.text", SHT_RELA, SHF_INFO_LINK, rela, sizeof(Elf64_Rela) * nrelocs, 8},
+        [SEC_SYMTAB] = {".symtab", SHT_SYMTAB, 0, symtab, sizeof(Elf64_Sym) * idx, 8},
+        [SEC_STRTAB] = {".strtab", SHT_STRTAB, 0, strtab.buf, strtab.len, 1},
+        [SEC_SHSTRTAB] = {".shstrtab", SHT_STRTAB, 0, NULL, 0, 1},
+        [SEC_NOTE_STACK] = {".note.GNU-stack", SHT_PROGBITS, 0, NULL, 0, 1},
+    };
+
+    Elf64_Shdr sh[NSECTIONS] = {};
+    Buffer shstrtab = {};
+    append(&shstrtab, "", 1);
+    for (int i = 1; i < NSECTIONS; i++) {
+        sh[i].sh_name = shstrtab.len;
+        append(&shstrtab, contents[i].name, strlen(contents[i].name) + 1);
+    }
+    contents[SEC_SHSTRTAB].p = shstrtab.buf;
+    contents[SEC_SHSTRTAB].len = shstrtab.len;
+
+    Buffer obj = {};
+    append(&obj, NULL, sizeof(Elf64_Ehdr));
+
+    for (int i = 1; i < NSECTIONS; i++) {
+        pad(&obj, contents[i].align);
+        sh[i].sh_type = contents[i].type;
+        sh[i].sh_flags = contents[i].flags;
+        sh[i].sh_offset = obj.len;
+        sh[i].sh_size = contents[i].len;
+        sh[i].sh_addralign = contents[i].align;
+        if (contents[i].len)
+            append(&obj, contents[i].p, contents[i].len);
+    }
+
+    sh[SEC_RELA_TEXT].sh_link = SEC_SYMTAB;
+    sh[SEC_RELA_TEXT].sh_info = SEC_TEXT;
+    sh[SEC_RELA_TEXT].sh_entsize = sizeof(Elf64_Rela);
+    sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    sh[SEC_SYMTAB].sh_info = nlocals;
+    sh[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+
+    pad(&obj, 8);
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)obj.buf;
+    memcpy(eh->e_ident, ELFMAG, SELFMAG);
+    eh->e_ident[EI_CLASS] = ELFCLASS64;
+    eh->e_ident[EI_DATA] = ELFDATA2LSB;
+    eh->e_ident[EI_VERSION] = EV_CURRENT;
+    eh->e_type = ET_REL;
+    eh->e_machine = EM_X86_64;
+    eh->e_version = EV_CURRENT;
+    eh->e_shoff = obj.len;
+    eh->e_ehsize = sizeof(Elf64_Ehdr);
+    eh->e_shentsize = sizeof(Elf64_Shdr);
+    eh->e_shnum = NSECTIONS;
+    eh->e_shstrndx = SEC_SHSTRTAB;
+    append(&obj, sh, sizeof(sh));
+
+    if (fwrite(obj.buf, 1, obj.len, out) != obj.len)
+        error("cannot write output: %s", strerror(errno));
+
+    for (int i = 0; i < nsyms; i++)
+        free(syms[i]);
+    free(syms);
+    free(symtab);
+    free(rela);
+    free(relocs);
+    free(strtab.buf);
+    free(shstrtab.buf);
+    free(obj.buf);
+    free(text.buf);
+    free(data.buf);
+    free(code.buf);
+    free(jumps);
+    free(labels);
+    free(fn_relocs);
+    free(sym_map.buckets);
+    text = data = code = (Buffer){};
+    syms = NULL;
+    relocs = fn_relocs = NULL;
+    jumps = NULL;
+    labels = NULL;
+    sym_map = (HashMap){};
+    nsyms = nrelocs = 0;
+    syms_cap = relocs_cap = jumps_cap = labels_cap = fn_relocs_cap = 0;
+}
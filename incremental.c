@@ -0,0 +1,345 @@
+// Function-granular incremental compilation (--incremental). The
+// assembly of each function is kept in a side database next to the
+// output, <output>.fndb, and is reused as long as neither the text of
+// the function, the macros and included files in effect, nor the
+// declarations of the globals it refers to have changed. Only the
+// declarator of such a function is tokenized and parsed; the other
+// functions are compiled as usual.
+//
+// The result is the same as that of a full compilation because the code
+// of a function, including its labels and string literals, depends only
+// on the function itself, on the preprocessor state before it and on
+// the types of the globals it uses. A function is reusable only if its
+// body has no directives, so that the state after its declarator is
+// all that its body depends on.
+//
+// Database format:
+//
+//   9cc-fndb <compiler digest>
+//   fn <name> <text digest> <header length> <preprocessor state> <number of refs> <assembly length>
+//   <global name> <declaration digest>     (once for each ref)
+//   <assembly>
+//   fn ...
+#define _DEFAULT_SOURCE
+#include "9cc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    char *name;
+    char *digest;        // digest of the function's text
+    int header_len;      // length of the text before the body
+    uint64_t pp_state;   // preprocess_state() after the text before the body
+    int nrefs;
+    char **ref_names;    // globals used by the function
+    char **ref_digests;  // and digests of their declarations
+    char *asm_text;
+    size_t asm_len;
+    bool generated;      // asm_text was generated by this compilation
+} FnEntry;
+
+// Functions in the database by the digest of their text, and
+// functions in this compilation by name
+static _Thread_local HashMap old_fns;
+static _Thread_local HashMap new_fns;
+
+// Digest of the declaration of each global, by name
+static _Thread_local HashMap decls;
+
+// The database, mapped copy-on-write so that it can be split up in place
+static _Thread_local char *db_buf;
+static _Thread_local size_t db_len;
+
+// Number of functions reused from the database
+static _Thread_local int nreused;
+
+static char *arena_digest(char *p, size_t len) {
+    char *d = digest(p, len);
+    char *s = arena_alloc(&global_arena, strlen(d) + 1);
+    strcpy(s, d);
+    free(d);
+    return s;
+}
+
+// Terminates the line at *rest and returns it, or returns NULL if
+// there is no complete line before end.
+static char *read_line(char **rest, char *end) {
+    char *p = *rest;
+    char *nl = memchr(p, '\n', end - p);
+    if (!nl)
+        return NULL;
+    *nl = '\0';
+    *rest = nl + 1;
+    return p;
+}
+
+static char *map_db(char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED)
+            buf = NULL;
+        *len = st.st_size;
+    }
+    close(fd);
+    return buf;
+}
+
+// Loads the functions in the database at path into old_fns. A missing
+// database, one written by another build of the compiler, or a broken
+// part of one, is treated as having no functions.
+static void load_db(char *path) {
+    db_buf = map_db(path, &db_len);
+    if (!db_buf)
+        return;
+
+    char *p = db_buf;
+    char *end = db_buf + db_len;
+    char *header = read_line(&p, end);
+    char *version = compiler_digest();
+    bool ok = header && !strncmp(header, "9cc-fndb ", 9) && !strcmp(header + 9, version);
+    free(version);
+    if (!ok)
+        return;
+
+    while (p < end) {
+        char *line = read_line(&p, end);
+        if (!line)
+            return;
+
+        FnEntry *e = arena_alloc(&global_arena, sizeof(FnEntry));
+        char *save;
+        char *tag = strtok_r(line, " ", &save);
+        e->name = strtok_r(NULL, " ", &save);
+        e->digest = strtok_r(NULL, " ", &save);
+        char *header_len = strtok_r(NULL, " ", &save);
+        char *pp_state = strtok_r(NULL, " ", &save);
+        char *nrefs = strtok_r(NULL, " ", &save);
+        char *asm_len = strtok_r(NULL, " ", &save);
+        if (!tag || strcmp(tag, "fn") || !asm_len)
+            return;
+
+        e->header_len = atoi(header_len);
+        e->pp_state = strtoull(pp_state, NULL, 16);
+        e->nrefs = atoi(nrefs);
+        e->asm_len = strtoull(asm_len, NULL, 10);
+        e->ref_names = arena_alloc(&global_arena, sizeof(char *) * e->nrefs);
+        e->ref_digests = arena_alloc(&global_arena, sizeof(char *) * e->nrefs);
+
+        for (int i = 0; i < e->nrefs; i++) {
+            char *ref = read_line(&p, end);
+            char *sp = ref ? strchr(ref, ' ') : NULL;
+            if (!sp)
+                return;
+            *sp = '\0';
+            e->ref_names[i] = ref;
+            e->ref_digests[i] = sp + 1;
+        }
+
+        if (end - p < e->asm_len)
+            return;
+        e->asm_text = p;
+        p += e->asm_len;
+        hashmap_put(&old_fns, e->digest, e);
+    }
+}
+
+// Returns true if none of the globals used by a function has changed.
+static bool refs_unchanged(FnEntry *e) {
+    for (int i = 0; i < e->nrefs; i++) {
+        char *d = hashmap_get(&decls, e->ref_names[i]);
+        if (!d || strcmp(d, e->ref_digests[i]))
+            return false;
+    }
+    return true;
+}
+
+// Makes an entry for the function defined by tok, whose text is
+// [start, end), or returns NULL if the function cannot be reused.
+static FnEntry *new_entry(char *start, char *end, Token *tok, char *text, HashMap *refs) {
+    // The body is the first "{" of a function definition. It must come
+    // from the function's own text, and no directive may follow it.
+    while (!equal_id(tok, '{'))
+        tok = tok->next;
+    if (tok->loc < start || end <= tok->loc)
+        return NULL;
+
+    char *line = tok->loc;
+    while (line > start && line[-1] != '\n')
+        line--;
+    if (memchr(line, '#', end - line))
+        return NULL;
+
+    FnEntry *e = arena_alloc(&global_arena, sizeof(FnEntry));
+    e->digest = text;
+    e->header_len = tok->loc - start;
+    e->pp_state = preprocess_state();
+    e->ref_names = arena_alloc(&global_arena, sizeof(char *) * refs->used);
+    e->ref_digests = arena_alloc(&global_arena, sizeof(char *) * refs->used);
+
+    for (int i = 0; i < refs->capacity; i++) {
+        char *ref = refs->buckets[i].key;
+        if (!ref)
+            continue;
+        e->ref_names[e->nrefs] = ref;
+        e->ref_digests[e->nrefs] = hashmap_get(&decls, ref);
+        e->nrefs++;
+    }
+    return e;
+}
+
+// Parses the preprocessed tokens of the top-level declaration [start,
+// end) and makes a database entry for it if it is a reusable function.
+// prev is the list of globals before it.
+static Obj *parse_decl(char *start, char *end, Token *tok, char *text, Obj *prev) {
+    char *name = function_name(tok);
+    HashMap refs = {};
+
+    referenced_globals = name ? &refs : NULL;
+    Obj *prog = parse_toplevel(tok);
+    referenced_globals = NULL;
+
+    // Text that declares more than one thing, say with an #include, is
+    // compiled every time.
+    if (name && prog->next == prev) {
+        FnEntry *e = new_entry(start, end, tok, text, &refs);
+        if (e) {
+            e->name = name;
+            hashmap_put(&new_fns, name, e);
+        }
+    }
+    free(refs.buckets);
+    return prog;
+}
+
+// Parses p, skipping the bodies of the functions that can be reused
+// from the database at db_path.
+Obj *parse_incremental(char *p, char *db_path) {
+    load_db(db_path);
+
+    Obj *prog = NULL;
+    preprocess_begin();
+    parse_begin();
+
+    while (*p) {
+        char *start = p;
+        p = toplevel_end(p);
+
+        // A declaration is identified by its text, so that one that
+        // can be reused is found before tokenizing it.
+        char *text = arena_digest(start, p - start);
+        FnEntry *e = hashmap_get(&old_fns, text);
+        Obj *prev = prog;
+        Token *tok;
+
+        if (e && refs_unchanged(e)) {
+            tok = preprocess_toplevel(tokenize_span(start, start + e->header_len));
+
+            if (preprocess_state() == e->pp_state) {
+                prog = declare_function(tok);
+                e->name = prog->name;
+                hashmap_put(&new_fns, e->name, e);
+                nreused++;
+                tok = NULL;
+            } else {
+                // The macros or headers before it have changed, so the
+                // function has to be compiled after all.
+                Token *body = preprocess_toplevel(tokenize_span(start + e->header_len, p));
+                tok = concat_tokens(tok, body);
+            }
+        } else {
+            tok = preprocess_toplevel(tokenize_span(start, p));
+        }
+
+        if (tok && tok->kind != TK_EOF)
+            prog = parse_decl(start, p, tok, text, prev);
+
+        for (Obj *var = prog; var != prev; var = var->next)
+            hashmap_put(&decls, var->name, text);
+    }
+
+    preprocess_end();
+    return prog;
+}
+
+static void save_db(Obj *prog, char *db_path) {
+    char *tmp = format("%s.tmp-%d", db_path, getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        error("cannot open %s: %s", tmp, strerror(errno));
+
+    char *version = compiler_digest();
+    fprintf(fp, "9cc-fndb %s\n", version);
+    free(version);
+
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function)
+            continue;
+
+        FnEntry *e = hashmap_get(&new_fns, fn->name);
+        if (!e)
+            continue;
+        fprintf(fp, "fn %s %s %d %016llx %d %zu\n", e->name, e->digest, e->header_len,
+                (unsigned long long)e->pp_state, e->nrefs, e->asm_len);
+        for (int i = 0; i < e->nrefs; i++)
+            fprintf(fp, "%s %s\n", e->ref_names[i], e->ref_digests[i]);
+        fwrite(e->asm_text, 1, e->asm_len, fp);
+    }
+
+    if (fclose(fp) || rename(tmp, db_path))
+        error("cannot write %s: %s", db_path, strerror(errno));
+    free(tmp);
+}
+
+// Writes the assembly for prog, generating only the functions that
+// were parsed, and updates the database.
+void codegen_incremental(Obj *prog, FILE *out, char *db_path) {
+    codegen_begin(out);
+    codegen_data(prog);
+
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        if (!fn->is_function)
+            continue;
+
+        FnEntry *e = hashmap_get(&new_fns, fn->name);
+        if (!e) {
+            codegen_function(fn);
+            continue;
+        }
+        if (!e->asm_text) {
+            e->asm_text = codegen_function_buf(fn, &e->asm_len);
+            e->generated = true;
+        }
+        codegen_text(e->asm_text, e->asm_len);
+    }
+    codegen_end();
+
+    // The database is left as it is if it already has exactly these
+    // functions.
+    if (nreused != old_fns.used || nreused != new_fns.used)
+        save_db(prog, db_path);
+
+    for (Obj *fn = prog; fn; fn = fn->next) {
+        FnEntry *e = fn->is_function ? hashmap_get(&new_fns, fn->name) : NULL;
+        if (e && e->generated) {
+            free(e->asm_text);
+            e->generated = false;
+        }
+    }
+
+    if (db_buf)
+        munmap(db_buf, db_len);
+    free(old_fns.buckets);
+    free(new_fns.buckets);
+    free(decls.buckets);
+    db_buf = NULL;
+    nreused = 0;
+    old_fns = new_fns = decls = (HashMap){};
+}
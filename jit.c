@@ -0,0 +1,293 @@
+// In-memory execution (--run). The program is encoded into an ELF
+// object in memory by codegen_object(). That object and any objects
+// given on the command line are then loaded into one mapping, relocated
+// and run in this process, as a tiny static linker would: the code of
+// all objects first, then the rest.
+//
+// 9cc is a static executable, so there is no dynamic symbol table in
+// which dlsym() could find libc functions. Undefined functions are
+// looked up in a table of the libc functions linked into 9cc instead.
+// Those are more than 2 GiB away from the mapping, so calls to them go
+// through stubs placed after the code, "jmp [rip]" followed by the
+// address, as in a PLT. The address also serves as the GOT entry for
+// GOTPCREL relocations.
+#define _DEFAULT_SOURCE
+#include "9cc.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STUB_SIZE 16
+
+typedef struct {
+    char *name;
+    char *buf;
+    size_t len;
+    Elf64_Ehdr *eh;
+    Elf64_Shdr *sh;
+    Elf64_Sym *syms;
+    int nsyms;
+    char *strtab;
+    char **addr;   // load address of each section, or NULL
+} ObjFile;
+
+static struct {
+    char *name;
+    void *addr;
+} libc_funcs[] = {
+    {"abort", abort},     {"calloc", calloc},   {"exit", exit},
+    {"fprintf", fprintf}, {"free", free},       {"malloc", malloc},
+    {"memcmp", memcmp},   {"memcpy", memcpy},   {"memmove", memmove},
+    {"memset", memset},   {"printf", printf},   {"putchar", putchar},
+    {"puts", puts},       {"realloc", realloc}, {"sprintf", sprintf},
+    {"snprintf", snprintf}, {"strcmp", strcmp}, {"strcpy", strcpy},
+    {"strlen", strlen},   {"strncmp", strncmp},
+};
+
+static HashMap globals;
+static char *stubs;
+static char *stubs_end;
+
+static void map_object(ObjFile *obj) {
+    int fd = open(obj->name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+        error("cannot open %s: %s", obj->name, strerror(errno));
+
+    obj->len = st.st_size;
+    obj->buf = mmap(NULL, obj->len ? obj->len : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (obj->buf == MAP_FAILED)
+        error("cannot read %s: %s", obj->name, strerror(errno));
+    close(fd);
+}
+
+static void read_object(ObjFile *obj) {
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)obj->buf;
+    if (obj->len < sizeof(Elf64_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+        eh->e_ident[EI_CLASS] != ELFCLASS64 || eh->e_type != ET_REL ||
+        eh->e_machine != EM_X86_64 || eh->e_shoff + eh->e_shnum * sizeof(Elf64_Shdr) > obj->len)
+        error("%s: not an x86-64 relocatable object", obj->name);
+
+    obj->eh = eh;
+    obj->sh = (Elf64_Shdr *)(obj->buf + eh->e_shoff);
+    obj->addr = calloc(eh->e_shnum, sizeof(char *));
+
+    for (int i = 0; i < eh->e_shnum; i++) {
+        if (obj->sh[i].sh_type != SHT_SYMTAB)
+            continue;
+        obj->syms = (Elf64_Sym *)(obj->buf + obj->sh[i].sh_offset);
+        obj->nsyms = obj->sh[i].sh_size / sizeof(Elf64_Sym);
+        obj->strtab = obj->buf + obj->sh[obj->sh[i].sh_link].sh_offset;
+    }
+}
+
+static char *section_name(ObjFile *obj, int i) {
+    return obj->buf + obj->sh[obj->eh->e_shstrndx].sh_offset + obj->sh[i].sh_name;
+}
+
+// Unwind tables are of no use here, so only the sections a program
+// needs at run time are loaded.
+static bool is_loaded(ObjFile *obj, int i) {
+    Elf64_Shdr *s = &obj->sh[i];
+    return (s->sh_flags & SHF_ALLOC) && strcmp(section_name(obj, i), ".eh_frame");
+}
+
+static size_t align_to_size(size_t n, size_t align) {
+    return align > 1 ? (n + align - 1) / align * align : n;
+}
+
+// Assigns offsets to the loaded sections that are code if exec is true,
+// or to the others, starting at offset.
+static size_t layout(ObjFile *objs, int nobjs, bool exec, size_t offset) {
+    for (int i = 0; i < nobjs; i++) {
+        for (int j = 0; j < objs[i].eh->e_shnum; j++) {
+            Elf64_Shdr *s = &objs[i].sh[j];
+            if (!is_loaded(&objs[i], j) || !!(s->sh_flags & SHF_EXECINSTR) != exec)
+                continue;
+            offset = align_to_size(offset, s->sh_addralign);
+            objs[i].addr[j] = (char *)offset;
+            offset += s->sh_size;
+        }
+    }
+    return offset;
+}
+
+static void define_globals(ObjFile *obj) {
+    for (int i = 1; i < obj->nsyms; i++) {
+        Elf64_Sym *sym = &obj->syms[i];
+        int bind = ELF64_ST_BIND(sym->st_info);
+        if ((bind != STB_GLOBAL && bind != STB_WEAK) || sym->st_shndx == SHN_UNDEF)
+            continue;
+
+        char *name = obj->strtab + sym->st_name;
+        if (sym->st_shndx == SHN_COMMON)
+            error("%s: %s: common symbols are not supported", obj->name, name);
+
+        char *addr = sym->st_shndx == SHN_ABS ? (char *)sym->st_value
+                                              : obj->addr[sym->st_shndx] + sym->st_value;
+        Elf64_Sym *prev = hashmap_get(&globals, name);
+        if (prev && bind == STB_WEAK)
+            continue;
+        if (prev && ELF64_ST_BIND(prev->st_info) == STB_GLOBAL)
+            error("%s: multiple definition of %s", obj->name, name);
+
+        // The symbol entry is reused to hold the address.
+        Elf64_Sym *def = calloc(1, sizeof(Elf64_Sym));
+        def->st_info = sym->st_info;
+        def->st_value = (uint64_t)addr;
+        hashmap_put(&globals, name, def);
+    }
+}
+
+// Returns a stub that jumps to addr, whose last 8 bytes hold addr.
+static char *stub(char *addr) {
+    for (char *p = stubs; p < stubs_end; p += STUB_SIZE)
+        if (*(char **)(p + 6) == addr)
+            return p;
+
+    char *p = stubs_end;
+    memcpy(p, "\xff\x25\x00\x00\x00\x00", 6);
+    memcpy(p + 6, &addr, 8);
+    stubs_end += STUB_SIZE;
+    return p;
+}
+
+static char *symbol_address(ObjFile *obj, int idx) {
+    Elf64_Sym *sym = &obj->syms[idx];
+    if (sym->st_shndx == SHN_ABS)
+        return (char *)sym->st_value;
+    if (sym->st_shndx != SHN_UNDEF) {
+        if (!obj->addr[sym->st_shndx])
+            error("%s: reference to a section that is not loaded", obj->name);
+        return obj->addr[sym->st_shndx] + sym->st_value;
+    }
+
+    char *name = obj->strtab + sym->st_name;
+    Elf64_Sym *def = hashmap_get(&globals, name);
+    if (def)
+        return (char *)def->st_value;
+    for (int i = 0; i < sizeof(libc_funcs) / sizeof(*libc_funcs); i++)
+        if (!strcmp(libc_funcs[i].name, name))
+            return libc_funcs[i].addr;
+    error("%s: undefined reference to %s", obj->name, name);
+}
+
+static bool fits_int32(int64_t v) {
+    return INT32_MIN <= v && v <= INT32_MAX;
+}
+
+static void relocate(ObjFile *obj) {
+    for (int i = 0; i < obj->eh->e_shnum; i++) {
+        Elf64_Shdr *s = &obj->sh[i];
+        if (s->sh_type != SHT_RELA || !obj->addr[s->sh_info])
+            continue;
+
+        Elf64_Rela *rels = (Elf64_Rela *)(obj->buf + s->sh_offset);
+        int nrels = s->sh_size / sizeof(Elf64_Rela);
+
+        for (int j = 0; j < nrels; j++) {
+            Elf64_Rela *r = &rels[j];
+            char *P = obj->addr[s->sh_info] + r->r_offset;
+            char *S = symbol_address(obj, ELF64_R_SYM(r->r_info));
+            int64_t A = r->r_addend;
+            int64_t v;
+
+            switch (ELF64_R_TYPE(r->r_info)) {
+            case R_X86_64_64:
+                *(uint64_t *)P = (uint64_t)(S + A);
+                continue;
+            case R_X86_64_PC32:
+            case R_X86_64_PLT32:
+                v = S + A - P;
+                if (!fits_int32(v))
+                    v = stub(S) + A - P;
+                break;
+            case R_X86_64_GOTPCREL:
+            case R_X86_64_GOTPCRELX:
+            case R_X86_64_REX_GOTPCRELX:
+                v = stub(S) + 6 + A - P;
+                break;
+            case R_X86_64_32:
+            case R_X86_64_32S:
+                v = (int64_t)(S + A);
+                break;
+            default:
+                error("%s: unsupported relocation type %d", obj->name,
+                      (int)ELF64_R_TYPE(r->r_info));
+            }
+
+            if (!fits_int32(v))
+                error("%s: relocation out of range", obj->name);
+            int32_t v32 = v;
+            memcpy(P, &v32, 4);
+        }
+    }
+}
+
+// Loads prog and the object files at paths, and returns the exit
+// status of main().
+int jit_run(Obj *prog, char *path, char **paths, int npaths) {
+    int nobjs = npaths + 1;
+    ObjFile *objs = calloc(nobjs, sizeof(ObjFile));
+
+    FILE *out = open_memstream(&objs[0].buf, &objs[0].len);
+    codegen_object(prog, out);
+    fclose(out);
+    objs[0].name = path;
+
+    for (int i = 0; i < npaths; i++) {
+        objs[i + 1].name = paths[i];
+        map_object(&objs[i + 1]);
+    }
+
+    int nrels = 0;
+    for (int i = 0; i < nobjs; i++) {
+        read_object(&objs[i]);
+        for (int j = 0; j < objs[i].eh->e_shnum; j++)
+            if (objs[i].sh[j].sh_type == SHT_RELA)
+                nrels += objs[i].sh[j].sh_size / sizeof(Elf64_Rela);
+    }
+
+    // Code and stubs come first, then the data in pages of its own, so
+    // that the code can be made executable and read-only.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t code_size = layout(objs, nobjs, true, 0);
+    size_t stubs_offset = align_to_size(code_size, STUB_SIZE);
+    size_t data_offset = align_to_size(stubs_offset + (size_t)nrels * STUB_SIZE, page);
+    size_t size = layout(objs, nobjs, false, data_offset);
+
+    char *base = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        error("mmap: %s", strerror(errno));
+    stubs = stubs_end = base + stubs_offset;
+
+    for (int i = 0; i < nobjs; i++) {
+        for (int j = 0; j < objs[i].eh->e_shnum; j++) {
+            if (!is_loaded(&objs[i], j))
+                continue;
+            objs[i].addr[j] += (size_t)base;
+            if (objs[i].sh[j].sh_type != SHT_NOBITS)
+                memcpy(objs[i].addr[j], objs[i].buf + objs[i].sh[j].sh_offset,
+                       objs[i].sh[j].sh_size);
+        }
+    }
+
+    for (int i = 0; i < nobjs; i++)
+        define_globals(&objs[i]);
+    for (int i = 0; i < nobjs; i++)
+        relocate(&objs[i]);
+
+    if (data_offset && mprotect(base, data_offset, PROT_READ | PROT_EXEC))
+        error("mprotect: %s", strerror(errno));
+
+    Elf64_Sym *main_sym = hashmap_get(&globals, "main");
+    if (!main_sym)
+        error("undefined reference to main");
+
+    char *argv[] = {path, NULL};
+    int (*main_fn)(int, char **) = (void *)main_sym->st_value;
+    return main_fn(1, argv);
+}
@@ -0,0 +1,60 @@
+// The compiler as a library: compiles a string in memory and returns
+// the assembly and diagnostics in memory.
+#include "9cc.h"
+#include "lib9cc.h"
+
+void compile_context_free(CompileContext *ctx) {
+    free(ctx->asm_text);
+    free(ctx->diag);
+    ctx->asm_text = NULL;
+    ctx->asm_len = 0;
+    ctx->diag = NULL;
+    ctx->diag_len = 0;
+}
+
+int compile(CompileContext *ctx, const char *src, size_t len) {
+    compile_context_free(ctx);
+
+    // The tokenizer expects the input to end with "\n\0".
+    char *buf = malloc(len + 2);
+    memcpy(buf, src, len);
+    buf[len] = '\n';
+    buf[len + 1] = '\0';
+
+    FILE *diag = open_memstream(&ctx->diag, &ctx->diag_len);
+    FILE *out = open_memstream(&ctx->asm_text, &ctx->asm_len);
+    if (!diag || !out)
+        error("cannot open memory stream: %s", strerror(errno));
+
+    // An error anywhere below jumps back here with everything the
+    // thread allocated still in its arenas.
+    jmp_buf jmp;
+    error_file = diag;
+    error_jmp = &jmp;
+
+    int ret = 0;
+    set_include_dirs(ctx->dir, ctx->include_paths, ctx->include_path_count);
+    if (setjmp(jmp) == 0) {
+        parse_begin();
+        Token *tok = tokenize_string(ctx->filename ? ctx->filename : "<input>", buf);
+        tok = preprocess(tok);
+        codegen(parse_toplevel(tok), out);
+    } else {
+        ret = -1;
+    }
+
+    reset_include_dirs();
+    error_file = NULL;
+    error_jmp = NULL;
+    fclose(diag);
+    fclose(out);
+    if (ret) {
+        free(ctx->asm_text);
+        ctx->asm_text = NULL;
+        ctx->asm_len = 0;
+    }
+
+    arena_release_all();
+    free(buf);
+    return ret;
+}
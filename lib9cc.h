@@ -0,0 +1,39 @@
+// Public interface of lib9cc, the compiler as a library.
+//
+// All compiler state is per thread, so any number of threads may
+// compile at the same time as long as each uses its own CompileContext.
+// Errors in the source are returned to the caller instead of ending
+// the process.
+#ifndef LIB9CC_H
+#define LIB9CC_H
+
+#include <stddef.h>
+
+typedef struct {
+    // Name of the input used in diagnostics. "<input>" if NULL.
+    char *filename;
+
+    // Directory that relative paths, including filename, are relative
+    // to. The working directory of the process if NULL.
+    char *dir;
+
+    // Directories searched by #include, in order
+    char **include_paths;
+    int include_path_count;
+
+    // Results of the last compile(). Both strings are NUL-terminated
+    // and owned by the context.
+    char *asm_text;   // generated assembly, NULL if compilation failed
+    size_t asm_len;
+    char *diag;       // diagnostics, "" if there were none
+    size_t diag_len;
+} CompileContext;
+
+// Compiles len bytes of C source at src. Returns 0 on success and -1
+// if the source has an error, which is then described in ctx->diag.
+int compile(CompileContext *ctx, const char *src, size_t len);
+
+// Frees the results held by ctx. ctx can be reused afterwards.
+void compile_context_free(CompileContext *ctx);
+
+#endif
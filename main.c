@@ -1,14 +1,61 @@
 #include "9cc.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 static char *opt_o;
+static bool opt_stats;
+static bool opt_cache_stats;
+static bool opt_stream;
+static bool opt_incremental;
+static char *opt_server;
+static char *opt_connect;
+static bool opt_emit_pch;
+static bool opt_c;
+static bool opt_link;
+static bool opt_run;
+static bool opt_whole_program;
 
-static char *input_path;
+static char **input_paths;
+static int input_count;
+
+// Object files and archives for --link or --run
+static char **link_inputs;
+static int link_input_count;
+
+// The running "cc" of --link
+static pid_t linker_pid;
 
 static void usage(int status) {
-    fprintf(stderr, "9cc [ -o <path> ] <file>\n");
+    fprintf(stderr, "9cc [ -c | --link ] [ -o <path> ] [ -I <dir> ] [ -j <threads> ] [ --stream ] [ --incremental ] [ --stats ] [ --hugepages ]\n"
+                    "    [ --connect <socket> ] [ --cache <dir> ] [ --cache-size <MiB> ] [ --cache-stats ]\n"
+                    "    <file>... [ <object or archive>... ]\n"
+                    "9cc --whole-program [ -c | --link | --run ] [ -o <path> ] [ -I <dir> ] [ -j <threads> ] [ --stats ]\n"
+                    "    <file>... [ <object or archive>... ]\n"
+                    "9cc --run [ -I <dir> ] <file> [ <object>... ]\n"
+                    "9cc --emit-pch [ -o <path> ] [ -I <dir> ] <header>...\n"
+                    "9cc [ -j <threads> ] [ --server-memory <MiB> ] --server <socket>\n");
     exit(status);
 }
 
+static bool ends_with(char *s, char *suffix) {
+    int len = strlen(s);
+    int n = strlen(suffix);
+    return len > n && !strcmp(s + len - n, suffix);
+}
+
+static void add_input(char *path) {
+    if (ends_with(path, ".o") || ends_with(path, ".a") || ends_with(path, ".so")) {
+        link_inputs = realloc(link_inputs, sizeof(char *) * (link_input_count + 1));
+        link_inputs[link_input_count++] = path;
+        return;
+    }
+    input_paths = realloc(input_paths, sizeof(char *) * (input_count + 1));
+    input_paths[input_count++] = path;
+}
+
 static void parse_args(int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--help"))
@@ -26,17 +73,250 @@ static void parse_args(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(argv[i], "-c")) {
+            opt_c = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--link")) {
+            opt_link = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--run")) {
+            opt_run = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--whole-program")) {
+            opt_whole_program = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-I")) {
+            if (!argv[++i])
+                usage(1);
+            add_include_path(argv[i]);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-I", 2)) {
+            add_include_path(argv[i] + 2);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-j")) {
+            if (!argv[++i])
+                usage(1);
+            opt_jobs = atoi(argv[i]);
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-j", 2)) {
+            opt_jobs = atoi(argv[i] + 2);
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--stream")) {
+            opt_stream = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--incremental")) {
+            opt_incremental = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--stats")) {
+            opt_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--server")) {
+            if (!argv[++i])
+                usage(1);
+            opt_server = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--server-memory")) {
+            if (!argv[++i])
+                usage(1);
+            opt_server_memory = strtoull(argv[i], NULL, 10) * 1024 * 1024;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--connect")) {
+            if (!argv[++i])
+                usage(1);
+            opt_connect = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--cache")) {
+            if (!argv[++i])
+                usage(1);
+            opt_cache = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--cache-size")) {
+            if (!argv[++i])
+                usage(1);
+            opt_cache_size = strtoull(argv[i], NULL, 10) * 1024 * 1024;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--cache-stats")) {
+            opt_cache_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--emit-pch")) {
+            opt_emit_pch = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--hugepages")) {
+            opt_hugepages = true;
+            continue;
+        }
+
         if (argv[i][0] == '-' && argv[i][1] != '\0')
             error("unknown argument: %s", argv[i]);
         
-        input_path = argv[i];
+        add_input(argv[i]);
+    }
+
+    if (opt_server) {
+        if (input_count > 0)
+            error("--server does not take input files");
+        return;
     }
 
-    if (!input_path)
+    if (input_count == 0)
         error("no input files");
+
+    if (opt_emit_pch && input_count > 1 && opt_o)
+        error("-o cannot be used with --emit-pch and multiple headers");
+
+    if (opt_c && (opt_stream || opt_incremental || opt_connect || opt_cache))
+        error("-c cannot be used with --stream, --incremental, --connect or --cache");
+
+    if (link_input_count > 0 && !opt_link && !opt_run)
+        error("%s: object files and archives need --link or --run", link_inputs[0]);
+
+    if (opt_run && (opt_c || opt_link || opt_o || opt_stream || opt_incremental ||
+                    opt_connect || opt_cache))
+        error("--run cannot be used with -c, --link, -o, --stream, --incremental, --connect or --cache");
+
+    if (opt_whole_program && (opt_stream || opt_incremental || opt_connect || opt_cache ||
+                              opt_emit_pch))
+        error("--whole-program cannot be used with --stream, --incremental, --connect, --cache or --emit-pch");
+
+    if (opt_run && input_count > 1 && !opt_whole_program)
+        error("--run takes a single C source file");
+
+    for (int i = 0; opt_run && i < link_input_count; i++)
+        if (!ends_with(link_inputs[i], ".o"))
+            error("%s: --run can only load object files", link_inputs[i]);
+
+    if (opt_link && opt_c)
+        error("-c cannot be used with --link");
+
+    if (opt_link && input_count > 1 && !opt_whole_program)
+        error("--link takes a single C source file");
+
+    if (opt_link && opt_o && !strcmp(opt_o, "-"))
+        error("--link cannot write to standard output");
+
+    if (opt_incremental && input_count == 1 && (!opt_o || !strcmp(opt_o, "-")))
+        error("--incremental needs an output file");
+
+    if (input_count > 1)
+        for (int i = 0; i < input_count; i++)
+            if (!strcmp(input_paths[i], "-"))
+                error("cannot read standard input with multiple input files");
+}
+
+// Stops the linker if the compilation fails, so that it does not link
+// partial assembly.
+static void kill_linker(void) {
+    if (linker_pid) {
+        kill(linker_pid, SIGTERM);
+        waitpid(linker_pid, NULL, 0);
+    }
+}
+
+// Starts "cc -o <output> -x assembler - <link inputs>" and returns a
+// stream to its standard input. The assembly is piped to the system
+// assembler while it is being generated, and cc then links the object
+// with the other inputs.
+static FILE *open_linker(char *output) {
+    int fds[2];
+    if (pipe(fds))
+        error("pipe: %s", strerror(errno));
+
+    char **argv = calloc(link_input_count + 10, sizeof(char *));
+    int argc = 0;
+    argv[argc++] = "cc";
+    argv[argc++] = "-o";
+    argv[argc++] = output ? output : "a.out";
+    argv[argc++] = "-Wa,--noexecstack";
+    argv[argc++] = "-x";
+    argv[argc++] = "assembler";
+    argv[argc++] = "-";
+    argv[argc++] = "-x";
+    argv[argc++] = "none";
+    for (int i = 0; i < link_input_count; i++)
+        argv[argc++] = link_inputs[i];
+
+    // A linker that exits early shows up as a write error instead.
+    signal(SIGPIPE, SIG_IGN);
+    fflush(NULL);
+
+    linker_pid = fork();
+    if (linker_pid < 0)
+        error("fork: %s", strerror(errno));
+    if (linker_pid == 0) {
+        dup2(fds[0], STDIN_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        fprintf(stderr, "cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    atexit(kill_linker);
+    close(fds[0]);
+    free(argv);
+    FILE *out = fdopen(fds[1], "w");
+    if (!out)
+        error("fdopen: %s", strerror(errno));
+    return out;
+}
+
+// Waits for the linker. Its diagnostics have gone straight to stderr;
+// its exit status becomes ours.
+static void close_linker(FILE *out) {
+    if (fclose(out))
+        error("cannot write to cc: %s", strerror(errno));
+
+    int status;
+    while (waitpid(linker_pid, &status, 0) < 0)
+        if (errno != EINTR)
+            error("waitpid: %s", strerror(errno));
+    linker_pid = 0;
+
+    if (WIFSIGNALED(status))
+        error("cc terminated by signal %d", WTERMSIG(status));
+    if (WEXITSTATUS(status))
+        exit(WEXITSTATUS(status));
 }
 
 static FILE *open_file(char *path) {
+    if (opt_link)
+        return open_linker(path);
     if (!path || strcmp(path, "-") == 0)
         return stdout;
     FILE *out = fopen(path, "w");
@@ -45,13 +325,259 @@ static FILE *open_file(char *path) {
     return out;
 }
 
+// Compiles one top-level declaration at a time. Each function is emitted
+// as soon as it has been parsed, and then its tokens and AST are freed,
+// so memory use is bounded by the largest function rather than by the
+// whole file. Global variables and string literals are emitted last.
+static void compile_stream(char *p, FILE *out) {
+    Obj *prog = NULL;
+
+    preprocess_begin();
+    parse_begin();
+    codegen_begin(out);
+
+    for (Token *tok; (tok = tokenize_toplevel(&p));) {
+        Obj *prev = prog;
+        prog = parse_toplevel(preprocess_toplevel(tok));
+
+        for (Obj *fn = prog; fn != prev; fn = fn->next) {
+            if (!fn->is_function)
+                continue;
+            codegen_function(fn);
+            fn->body = NULL;
+            fn->literals = NULL;
+            fn->params = NULL;
+            fn->locals = NULL;
+        }
+
+        arena_release(&node_arena);
+        arena_release(&token_arena);
+    }
+
+    preprocess_end();
+    codegen_data(prog);
+    codegen_end();
+}
+
+// Compiles p, the contents of path, to out. If out is NULL, output is
+// opened once the input has been compiled without errors.
+static FILE *generate(char *path, char *p, char *output, FILE *out) {
+    if (opt_connect) {
+        size_t len;
+        char *asm_text = compile_remote(opt_connect, path, p, &len);
+        if (!out)
+            out = open_file(output);
+        fwrite(asm_text, 1, len, out);
+        free(asm_text);
+    } else if (opt_incremental) {
+        // The database of reusable functions lives next to the output.
+        char *db_path = format("%s.fndb", output);
+        Obj *prog = parse_incremental(p, db_path);
+        if (!out)
+            out = open_file(output);
+        codegen_incremental(prog, out, db_path);
+        free(db_path);
+    } else if (opt_stream) {
+        if (!out)
+            out = open_file(output);
+        compile_stream(p, out);
+    } else {
+        // The parser is started first, as a precompiled header included
+        // by the preprocessor declares globals.
+        parse_begin();
+        Token *tok = preprocess(tokenize_string(path, p));
+        Obj *prog = parse_toplevel(tok);
+
+        if (!out)
+            out = open_file(output);
+        if (opt_c)
+            codegen_object(prog, out);
+        else
+            codegen(prog, out);
+    }
+    return out;
+}
+
+// With --cache, the assembly is generated into memory so that it can
+// be written to both the cache and the output.
+static FILE *compile_cached(char *path, char *p, char *output) {
+    char *key = cache_key(path, p, opt_stream);
+    size_t len;
+    char *buf = cache_load(key, &len);
+
+    if (!buf) {
+        long long start = now_ns();
+        fclose(generate(path, p, output, open_memstream(&buf, &len)));
+
+        // The files that a compile server included are not known here,
+        // so its results are cached only for inputs without #include.
+        char *deps = preprocess_deps();
+        if (!opt_connect || !strstr(p, "#include"))
+            cache_store(key, buf, len, now_ns() - start, deps);
+        free(deps);
+    }
+
+    FILE *out = open_file(output);
+    fwrite(buf, 1, len, out);
+    free(buf);
+    free(key);
+    return out;
+}
+
+static void compile_file(char *path, char *output) {
+    char *p = read_input(path);
+    FILE *out;
+
+    if (opt_cache)
+        out = compile_cached(path, p, output);
+    else
+        out = generate(path, p, output, NULL);
+
+    if (opt_link)
+        close_linker(out);
+    else if (out != stdout)
+        fclose(out);
+
+    if (opt_stats) {
+        flockfile(stderr);
+        if (input_count > 1)
+            fprintf(stderr, "%s:\n", path);
+        print_arena_stats(stderr);
+        funlockfile(stderr);
+    }
+
+    arena_release_all();
+}
+
+// Compiles path and runs its main() in this process.
+static int run_file(char *path) {
+    char *p = read_input(path);
+    parse_begin();
+    Obj *prog = parse_toplevel(preprocess(tokenize_string(path, p)));
+    return jit_run(prog, path, link_inputs, link_input_count);
+}
+
+// Returns the output path for a given input when there are several
+// inputs: foo/bar.c becomes <dir>/bar.s with "-o <dir>", or foo/bar.s.
+// With -c, the output is bar.o instead.
+static char *output_path(char *path) {
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    char *dot = strrchr(base, '.');
+    int len = dot ? dot - base : strlen(base);
+
+    char *ext = opt_c ? "o" : "s";
+    if (opt_o)
+        return format("%s/%.*s.%s", opt_o, len, base, ext);
+    return format("%.*s.%s", (int)(base - path) + len, path, ext);
+}
+
+// Parses all input files into one program and compiles it to a single
+// output, named after the first input like that of a single file. The
+// arenas are kept until the end, as the globals of every file are
+// needed at once.
+static void compile_whole_program(void) {
+    Obj **progs = calloc(input_count, sizeof(Obj *));
+    char **contents = calloc(input_count, sizeof(char *));
+
+    for (int i = 0; i < input_count; i++) {
+        contents[i] = read_input(input_paths[i]);
+        parse_begin();
+        progs[i] = parse_toplevel(preprocess(tokenize_string(input_paths[i], contents[i])));
+    }
+
+    // Each file started a new list of input files; the earlier ones are
+    // put back so that errors can name them.
+    for (int i = 0; i < input_count - 1; i++)
+        add_input_file(input_paths[i], contents[i]);
+
+    int nremoved;
+    Obj *prog = link_program(progs, input_count, &nremoved);
+
+    if (opt_run)
+        exit(jit_run(prog, input_paths[0], link_inputs, link_input_count));
+
+    char *output = opt_o;
+    if (opt_c && !opt_o)
+        output = output_path(input_paths[0]);
+
+    FILE *out = open_file(output);
+    if (opt_c)
+        codegen_object(prog, out);
+    else
+        codegen(prog, out);
+
+    if (opt_link)
+        close_linker(out);
+    else if (out != stdout)
+        fclose(out);
+
+    if (opt_stats) {
+        fprintf(stderr, "unreachable functions removed: %d\n", nremoved);
+        print_arena_stats(stderr);
+    }
+    free(progs);
+    free(contents);
+}
+
+static atomic_int next_input;
+
+// Compiles input files until there are none left.
+static void *compile_worker(void *arg) {
+    for (;;) {
+        int i = atomic_fetch_add(&next_input, 1);
+        if (i >= input_count)
+            return NULL;
+        compile_file(input_paths[i], output_path(input_paths[i]));
+    }
+}
+
+// Compiles all input files on up to opt_jobs threads. Each file is
+// compiled by a single thread, so the threads used by -j within one
+// file are turned off.
+static void compile_files(void) {
+    int nthreads = opt_jobs < input_count ? opt_jobs : input_count;
+    opt_jobs = 1;
+
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++)
+        if (pthread_create(&threads[i], NULL, compile_worker, NULL))
+            error("cannot create a thread");
+    compile_worker(NULL);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
 int main(int argc, char **argv) {
     parse_args(argc, argv);
-    
-    Token *tok = tokenize_file(input_path);
-    Obj *prog = parse(tok);
 
-    FILE *out = open_file(opt_o);
-    codegen(prog, out);
+    if (opt_server) {
+        serve(opt_server);
+        return 0;
+    }
+
+    if (opt_emit_pch) {
+        for (int i = 0; i < input_count; i++) {
+            write_pch(input_paths[i], opt_o ? opt_o : format("%s.pch", input_paths[i]));
+            arena_release_all();
+        }
+        return 0;
+    }
+
+    if (opt_whole_program)
+        compile_whole_program();
+    else if (opt_run)
+        exit(run_file(input_paths[0]));
+    else if (input_count == 1 && opt_c && !opt_o)
+        compile_file(input_paths[0], output_path(input_paths[0]));
+    else if (input_count == 1)
+        compile_file(input_paths[0], opt_o);
+    else
+        compile_files();
+
+    if (opt_cache_stats)
+        print_cache_stats(stderr);
     return 0;
 }
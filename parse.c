@@ -1,9 +1,13 @@
 #include "9cc.h"
 
+// 入力はpreprocess_toplevel()が返すトークンの配列なので、先読みは
+// tok->nextをたどらず、tok + 1、tok + 2のように添字の計算で行う
+
 // scope for local or global variables
 typedef struct VarScope VarScope;
 struct VarScope {
-    VarScope *next;
+    VarScope *next;    // 同じブロックで宣言された変数
+    VarScope *shadow;  // この変数が隠している外側の変数
     char *name;
     Obj *var;
 };
@@ -15,48 +19,58 @@ struct Scope {
     VarScope *vars;
 };
 
-static Obj *locals;
-static Obj *globals;
+// 複数のファイルを別々のスレッドで読めるよう、状態はスレッドごとに持つ
+static _Thread_local Obj *locals;
+static _Thread_local Obj *globals;
+
+static _Thread_local Scope file_scope;
+static _Thread_local Scope *scope;
+
+// 名前から現在見えている変数への表
+static _Thread_local HashMap visible_vars;
 
-static Scope *scope = &(Scope){};
+// NULLでなければ、関数本体から参照したグローバル変数を名前で記録する
+_Thread_local HashMap *referenced_globals;
 
 static Type *declspec(Token **rest, Token *tok);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name);
 static Node *declaration(Token **rest, Token *tok);
 static Node *compound_stmt(Token **rest, Token *tok);
 static Node *stmt(Token **rest, Token *tok);
 static Node *expr_stmt(Token **rest, Token *tok);
 static Node *expr(Token **rest, Token *tok);
 static Node *assign(Token **rest, Token *tok);
-static Node *equality(Token **rest, Token *tok);
-static Node *relational(Token **rest, Token *tok);
-static Node *add(Token **rest, Token *tok);
-static Node *mul(Token **rest, Token *tok);
+static Node *binary(Token **rest, Token *tok, int min_prec);
 static Node *postfix(Token **rest, Token *tok);
 static Node *unary(Token **rest, Token *tok);
 static Node *primary(Token **rest, Token *tok);
 
 static void enter_scope(void) {
-    Scope *sc = calloc(1, sizeof(Scope));
+    Scope *sc = arena_alloc(&node_arena, sizeof(Scope));
     sc->next = scope;
     scope = sc;
 }
 
+// Undo the declarations of the innermost scope so that the variables
+// they were shadowing become visible again.
 static void leave_scope(void) {
+    for (VarScope *sc = scope->vars; sc; sc = sc->next) {
+        if (sc->shadow)
+            hashmap_put(&visible_vars, sc->name, sc->shadow);
+        else
+            hashmap_delete(&visible_vars, sc->name);
+    }
     scope = scope->next;
 }
 
 // 変数を名前で探す
 static Obj *find_var(Token *tok) {
-    for (Scope *sc = scope; sc; sc = sc->next)
-        for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
-            if (equal(tok, sc2->name))
-                return sc2->var;
-    return NULL;
+    VarScope *sc = hashmap_get2(&visible_vars, tok->name, tok->len);
+    return sc ? sc->var : NULL;
 }
 
 static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&node_arena, sizeof(Node));
     node->kind = kind;
     node->tok = tok;
     return node;
@@ -87,17 +101,25 @@ static Node *new_var_node(Obj *var, Token *tok) {
     return node;
 }
 
+// 関数の中のものはnode_arenaに、ファイルスコープのものはglobal_arenaに置く。
+// --streamでは関数ごとにnode_arenaを解放する
+static Arena *scope_arena(void) {
+    return scope->next ? &node_arena : &global_arena;
+}
+
 static VarScope *push_scope(char *name, Obj *var) {
-    VarScope *sc = calloc(1, sizeof(VarScope));
+    VarScope *sc = arena_alloc(scope_arena(), sizeof(VarScope));
     sc->name = name;
     sc->var = var;
+    sc->shadow = hashmap_get(&visible_vars, name);
     sc->next = scope->vars;
     scope->vars = sc;
+    hashmap_put(&visible_vars, name, sc);
     return sc;
 }
 
-static Obj *new_var(char *name, Type *ty) {
-    Obj *var = calloc(1, sizeof(Obj));
+static Obj *new_var(char *name, Type *ty, Arena *arena) {
+    Obj *var = arena_alloc(arena, sizeof(Obj));
     var->name = name;
     var->ty = ty;
     push_scope(name, var);
@@ -105,7 +127,7 @@ static Obj *new_var(char *name, Type *ty) {
 }
 
 static Obj *new_lvar(char *name, Type *ty) {
-    Obj *var = new_var(name, ty);
+    Obj *var = new_var(name, ty, &node_arena);
     var->is_local = true;
     var->next = locals;
     locals = var;
@@ -113,31 +135,40 @@ static Obj *new_lvar(char *name, Type *ty) {
 }
 
 static Obj *new_gvar(char *name, Type *ty) {
-    Obj *var = new_var(name, ty);
+    Obj *var = new_var(name, ty, &global_arena);
     var->next = globals;
     globals = var;
     return var;
 }
 
-static char *new_unique_name(void) {
-    static int id = 0;
-    return format(".L..%d", id++);
-}
+// 今パースしている関数
+static _Thread_local Obj *current_fn;
+static _Thread_local int unique_id;
 
-static Obj *new_anon_gvar(Type * ty) {
-    return new_gvar(new_unique_name(), ty);
+// 番号は関数ごとに振り、名前に関数名を含めるので、他の関数が変わっても
+// 名前は変わらない
+static char *new_unique_name(void) {
+    char *buf = arena_alloc(&node_arena, strlen(current_fn->name) + 20);
+    sprintf(buf, ".L..%s.%d", current_fn->name, unique_id++);
+    return buf;
 }
 
-static Obj * new_string_literal(char *p, Type *ty) {
-    Obj *var = new_anon_gvar(ty);
+// 文字列リテラルはその関数と一緒に出力するので、関数のノードと同じだけ
+// 生きていればよい
+static Obj *new_string_literal(char *p, Type *ty) {
+    Obj *var = arena_alloc(&node_arena, sizeof(Obj));
+    var->name = new_unique_name();
+    var->ty = ty;
     var->init_data = p;
+    var->next = current_fn->literals;
+    current_fn->literals = var;
     return var;
 }
 
 static char *get_ident(Token *tok) {
     if (tok->kind != TK_IDENT)
         error_tok(tok, "expected an identifier");
-    return strndup(tok->loc, tok->len);
+    return tok->name;
 }
 
 static int get_number(Token *tok) {
@@ -148,12 +179,12 @@ static int get_number(Token *tok) {
 
 // declspec =  "char" | "int"
 static Type *declspec(Token **rest, Token *tok) {
-    if (equal(tok, "char")) {
-        *rest = skip(tok, "char");
+    if (equal_id(tok, KW_CHAR)) {
+        *rest = skip_id(tok, KW_CHAR);
         return ty_char;
     }
     
-    *rest = skip(tok, "int");
+    *rest = skip_id(tok, KW_INT);
     return ty_int;
 }
 
@@ -163,25 +194,29 @@ static Type *func_params(Token **rest, Token *tok, Type *ty) {
     Type head = {};
     Type *cur = &head;
 
-    while (!equal(tok, ")")) {
+    while (!equal_id(tok, ')')) {
         if (cur != &head)
-            tok = skip(tok, ",");
+            tok = skip_id(tok, ',');
         Type *basety = declspec(&tok, tok);
-        Type *ty = declarator(&tok, tok, basety);
+        Token *name;
+        Type *ty = declarator(&tok, tok, basety, &name);
+
+        // パラメータは宣言ごとに名前を持つので、共有の型をコピーして使う
         cur = cur->next = copy_type(ty);
+        cur->name = name;
     }
 
     ty = func_type(ty);
     ty->params = head.next;
-    *rest = tok->next;
+    *rest = tok + 1;
     return ty;
 }
 
 // array_suffix = ( "[" num "]" )*
 static Type *array_suffix(Token **rest, Token *tok, Type *ty) {
-    int sz = get_number(tok->next);
-    tok = skip(tok->next->next, "]");
-    if (!equal(tok, "[")) {
+    int sz = get_number(tok + 1);
+    tok = skip_id(tok + 2, ']');
+    if (!equal_id(tok, '[')) {
         *rest = tok;
         return array_of(ty, sz);
     }
@@ -192,10 +227,10 @@ static Type *array_suffix(Token **rest, Token *tok, Type *ty) {
 //             | array_suffix
 //             | ε
 static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
-    if (equal(tok, "("))
-        return func_params(rest, tok->next, ty);
+    if (equal_id(tok, '('))
+        return func_params(rest, tok + 1, ty);
 
-    if (equal(tok, "["))
+    if (equal_id(tok, '['))
         return array_suffix(rest, tok, ty);
 
     *rest = tok;
@@ -203,15 +238,15 @@ static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
 }
 
 // declarator = "*"* ident type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
-    while (consume(&tok, tok, "*"))
+// 型は共有されるので、宣言された名前は*nameに返す
+static Type *declarator(Token **rest, Token *tok, Type *ty, Token **name) {
+    while (consume_id(&tok, tok, '*'))
         ty = pointer_to(ty);
     
     if (tok->kind != TK_IDENT)
         error_tok(tok, "expected a variable name");
-    ty = type_suffix(rest, tok->next, ty);
-    ty->name = tok;
-    return ty;
+    *name = tok;
+    return type_suffix(rest, tok + 1, ty);
 }
 
 // declaration = declspec (declarator ("=" expr)? ("," declarator ("=" expr)?)*)? ";"
@@ -222,30 +257,31 @@ static Node *declaration(Token **rest, Token *tok) {
     Node *cur = &head;
     int i = 0;
 
-    while (!equal(tok, ";")) {
+    while (!equal_id(tok, ';')) {
         if (i++ > 0)
-            tok = skip(tok, ",");
+            tok = skip_id(tok, ',');
         
-        Type *ty = declarator(&tok, tok, basety);
-        Obj *var = new_lvar(get_ident(ty->name), ty);
+        Token *name;
+        Type *ty = declarator(&tok, tok, basety, &name);
+        Obj *var = new_lvar(get_ident(name), ty);
 
-        if (!equal(tok, "="))
+        if (!equal_id(tok, '='))
             continue;
         
-        Node *lhs = new_var_node(var, ty->name);
-        Node *rhs = assign(&tok, tok->next);
+        Node *lhs = new_var_node(var, name);
+        Node *rhs = assign(&tok, tok + 1);
         Node *node = new_binary(ND_ASSIGN, lhs, rhs, tok);
         cur = cur->next = new_unary(ND_EXPR_STMT, node, tok);
     }
 
     Node *node = new_node(ND_BLOCK, tok);
     node->body = head.next;
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
 }
 
 static bool is_typename(Token *tok) {
-    return equal(tok, "char") || equal(tok, "int");
+    return equal_id(tok, KW_CHAR) || equal_id(tok, KW_INT);
 }
 
 // stmt = "return" expr ";"
@@ -255,54 +291,54 @@ static bool is_typename(Token *tok) {
 //      | "{" compound-stmt
 //      | expr-stmt
 static Node *stmt(Token **rest, Token *tok) {
-    if (equal(tok, "return")) {
+    if (equal_id(tok, KW_RETURN)) {
         Node *node = new_node(ND_RETURN, tok);
-        node->lhs = expr(&tok, tok->next);
-        *rest = skip(tok, ";");
+        node->lhs = expr(&tok, tok + 1);
+        *rest = skip_id(tok, ';');
         return node;
     }
 
-    if (equal(tok, "if")) {
+    if (equal_id(tok, KW_IF)) {
         Node *node = new_node(ND_IF, tok);
-        tok = skip(tok->next, "(");
+        tok = skip_id(tok + 1, '(');
         node->cond = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip_id(tok, ')');
         node->then = stmt(&tok, tok);
-        if (equal(tok, "else"))
-            node->els = stmt(&tok, tok->next);
+        if (equal_id(tok, KW_ELSE))
+            node->els = stmt(&tok, tok + 1);
         *rest = tok;
         return node;
     }
 
-    if (equal(tok, "for")) {
+    if (equal_id(tok, KW_FOR)) {
         Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
+        tok = skip_id(tok + 1, '(');
 
         node->init = expr_stmt(&tok, tok);
 
-        if (!equal(tok, ";"))
+        if (!equal_id(tok, ';'))
             node->cond = expr(&tok, tok);
-        tok = skip(tok, ";");
+        tok = skip_id(tok, ';');
 
-        if (!equal(tok, ")"))
+        if (!equal_id(tok, ')'))
             node->inc = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip_id(tok, ')');
 
         node->then = stmt(rest, tok);
         return node;
     }
 
-    if (equal(tok, "while")) {
+    if (equal_id(tok, KW_WHILE)) {
         Node *node = new_node(ND_FOR, tok);
-        tok = skip(tok->next, "(");
+        tok = skip_id(tok + 1, '(');
         node->cond = expr(&tok, tok);
-        tok = skip(tok, ")");
+        tok = skip_id(tok, ')');
         node->then = stmt(rest, tok);
         return node;
     }
 
-    if (equal(tok, "{"))
-        return compound_stmt(rest, tok->next);
+    if (equal_id(tok, '{'))
+        return compound_stmt(rest, tok + 1);
 
     return expr_stmt(rest, tok);
 }
@@ -316,7 +352,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
 
     enter_scope();
 
-    while (!equal(tok, "}")) {
+    while (!equal_id(tok, '}')) {
         if (is_typename(tok))
             cur = cur->next = declaration(&tok, tok);
         else
@@ -327,20 +363,20 @@ static Node *compound_stmt(Token **rest, Token *tok) {
     leave_scope();
     
     node->body = head.next;
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
 }
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
-    if (equal(tok, ";")) {
-        *rest = tok->next;
+    if (equal_id(tok, ';')) {
+        *rest = tok + 1;
         return new_node(ND_BLOCK, tok);
     }
 
     Node *node = new_node(ND_EXPR_STMT, tok);
     node->lhs = expr(&tok, tok);
-    *rest = skip(tok, ";");
+    *rest = skip_id(tok, ';');
     return node;
 }
 
@@ -349,66 +385,16 @@ static Node *expr(Token **rest, Token *tok) {
     return assign(rest, tok);
 }
 
-// assign = equality ("=" assign)?
+// assign = binary ("=" assign)?
 static Node *assign(Token **rest, Token *tok) {
-    Node *node = equality(&tok, tok);
+    Node *node = binary(&tok, tok, 1);
 
-    if (equal(tok, "="))
-        return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+    if (equal_id(tok, '='))
+        return new_binary(ND_ASSIGN, node, assign(rest, tok + 1), tok);
     *rest = tok;
     return node;
 }
 
-// equality = relational ("==" relational | "!=" relational)*
-static Node *equality(Token **rest, Token *tok) {
-    Node *node = relational(&tok, tok);
-
-    for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "==")) {
-            node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
-            continue;
-        }
-        if (equal(tok, "!=")) {
-            node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
-            continue;
-        }
-        *rest = tok;
-        return node;
-            
-    }
-}
-
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-static Node *relational(Token **rest, Token *tok) {
-    Node *node = add(&tok, tok);
-
-    for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "<")) {
-            node = new_binary(ND_LT, node, add(&tok, tok->next), start);
-            continue;
-        }
-        if (equal(tok, "<=")) {
-            node = new_binary(ND_LE, node, add(&tok, tok->next), start);
-            continue;
-        }
-        if (equal(tok, ">")) {
-            node = new_binary(ND_LT, add(&tok, tok->next), node, start);
-            continue;
-        }
-        if (equal(tok, ">=")) {
-            node = new_binary(ND_LE, add(&tok, tok->next), node, start);
-            continue;
-        }
-            
-        *rest = tok;
-        return node;
-    }
-}
-
 // '+' operatorが引数によって異なる挙動を示すことに対応。
 static Node *new_add(Node *lhs, Node *rhs, Token *tok) {
     add_type(lhs);
@@ -461,45 +447,64 @@ static Node *new_sub(Node *lhs, Node *rhs, Token *tok) {
     error_tok(tok, "invalid operands");
 }
 
-// add = mul ("+" mul | "-" mul)*
-static Node *add(Token **rest, Token *tok) {
-    Node *node = mul(&tok, tok);
+// 二項演算子の表。トークンの番号で引き、precが大きいほど強く結合する。
+// precが0のものは二項演算子ではない。演算子を追加するときはここに1行足せばよい
+typedef struct {
+    int prec;
+    NodeKind kind;
+    bool swap;  // "a > b"を"b < a"として表す
+} BinOp;
+
+static BinOp binops[TOKEN_ID_END] = {
+    [P_EQ] = {1, ND_EQ},
+    [P_NE] = {1, ND_NE},
+    ['<'] = {2, ND_LT},
+    [P_LE] = {2, ND_LE},
+    ['>'] = {2, ND_LT, true},
+    [P_GE] = {2, ND_LE, true},
+    ['+'] = {3, ND_ADD},
+    ['-'] = {3, ND_SUB},
+    ['*'] = {4, ND_MUL},
+    ['/'] = {4, ND_DIV},
+};
 
-    for (;;) {
-        Token *start = tok;
+static BinOp *find_binop(Token *tok) {
+    BinOp *op = &binops[tok->id];
+    return op->prec ? op : NULL;
+}
 
-        if (equal(tok, "+")) {
-            node = new_add(node, mul(&tok, tok->next), start);
-            continue;
-        }
-            
-        if (equal(tok, "-")) {
-            node = new_sub(node, mul(&tok, tok->next), start);
-            continue;
-        }
-        *rest = tok;
-        return node;
+static Node *new_binop(BinOp *op, Node *lhs, Node *rhs, Token *tok) {
+    if (op->swap) {
+        Node *tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
     }
+
+    if (op->kind == ND_ADD)
+        return new_add(lhs, rhs, tok);
+    if (op->kind == ND_SUB)
+        return new_sub(lhs, rhs, tok);
+    return new_binary(op->kind, lhs, rhs, tok);
 }
 
-// mul = unary ("*" unary | "/" unary)*
-static Node *mul(Token **rest, Token *tok) {
+// binary = unary (binop unary)*
+//
+// 優先順位がmin_prec以上の演算子だけを読む (precedence climbing)。
+// 右辺はより強く結合する演算子だけを読むので、同じ優先順位の演算子は
+// 左結合になる。
+static Node *binary(Token **rest, Token *tok, int min_prec) {
     Node *node = unary(&tok, tok);
 
     for (;;) {
-        Token *start = tok;
-
-        if (equal(tok, "*")) {
-            node = new_binary(ND_MUL, node, unary(&tok, tok->next), start);
-            continue;
+        BinOp *op = find_binop(tok);
+        if (!op || op->prec < min_prec) {
+            *rest = tok;
+            return node;
         }
-            
-        if (equal(tok, "/")) {
-            node = new_binary(ND_DIV, node, unary(&tok, tok->next), start);
-            continue;
-        }
-        *rest = tok;            
-        return node;
+
+        Token *start = tok;
+        Node *rhs = binary(&tok, tok + 1, op->prec + 1);
+        node = new_binop(op, node, rhs, start);
     }
 }
 
@@ -507,19 +512,19 @@ static Node *mul(Token **rest, Token *tok) {
 //       | ("+" | "-" | "*" | "&") unary
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
-    if (equal(tok, "sizeof")) {
-        Node *node = unary(rest, tok->next);
+    if (equal_id(tok, KW_SIZEOF)) {
+        Node *node = unary(rest, tok + 1);
         add_type(node);
         return new_num(node->ty->size, tok);
     }
-    if (equal(tok, "+"))
-        return unary(rest, tok->next);
-    if (equal(tok, "-"))
-        return new_unary(ND_NEG, unary(rest, tok->next), tok);
-    if (equal(tok, "&"))
-        return new_unary(ND_ADDR, unary(rest, tok->next), tok);
-    if (equal(tok, "*"))
-        return new_unary(ND_DEREF, unary(rest, tok->next), tok);
+    if (equal_id(tok, '+'))
+        return unary(rest, tok + 1);
+    if (equal_id(tok, '-'))
+        return new_unary(ND_NEG, unary(rest, tok + 1), tok);
+    if (equal_id(tok, '&'))
+        return new_unary(ND_ADDR, unary(rest, tok + 1), tok);
+    if (equal_id(tok, '*'))
+        return new_unary(ND_DEREF, unary(rest, tok + 1), tok);
     return postfix(rest, tok);
 }
 
@@ -527,11 +532,11 @@ static Node *unary(Token **rest, Token *tok) {
 static Node *postfix(Token **rest, Token *tok) {
     Node *node = primary(&tok, tok);
 
-    while (equal(tok, "[")) {
+    while (equal_id(tok, '[')) {
         // x[y] is short for *(x+y)
         Token *start = tok;
-        Node *idx = expr(&tok, tok->next);
-        tok = skip(tok, "]");
+        Node *idx = expr(&tok, tok + 1);
+        tok = skip_id(tok, ']');
         node = new_unary(ND_DEREF, new_add(node, idx, start), start);
     }
     *rest = tok;
@@ -541,21 +546,21 @@ static Node *postfix(Token **rest, Token *tok) {
 // funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
     Token *start = tok;
-    tok = tok->next->next;
+    tok += 2;
 
     Node head = {};
     Node *cur = &head;
 
-    while (!equal(tok, ")")) {
+    while (!equal_id(tok, ')')) {
         if (cur != &head)
-            tok = skip(tok, ",");
+            tok = skip_id(tok, ',');
         cur = cur->next = assign(&tok, tok);
     }
 
-    *rest = skip(tok, ")");
+    *rest = skip_id(tok, ')');
 
     Node *node = new_node(ND_FUNCALL, start);
-    node->funcname = strndup(start->loc, start->len);
+    node->funcname = start->name;
     node->args = head.next;
     return node;
 }
@@ -566,43 +571,45 @@ static Node *funcall(Token **rest, Token *tok) {
 //         | str
 //         | num
 static Node *primary(Token **rest, Token *tok) {
-    if (equal(tok, "(") && equal(tok->next, "{")) {
+    if (equal_id(tok, '(') && equal_id(tok + 1, '{')) {
         // GNU statement expressionの場合
         Node *node = new_node(ND_STMT_EXPR, tok);
-        node->body = compound_stmt(&tok, tok->next->next)->body;
-        *rest = skip(tok, ")");
+        node->body = compound_stmt(&tok, tok + 2)->body;
+        *rest = skip_id(tok, ')');
         return node;
     }
 
     // 次のトークンが"("なら、"(" expr ")"のはず
-    if (equal(tok, "(")) {
-        Node *node = expr(&tok, tok->next);
-        *rest = skip(tok, ")");
+    if (equal_id(tok, '(')) {
+        Node *node = expr(&tok, tok + 1);
+        *rest = skip_id(tok, ')');
         return node;
     }
 
     if (tok->kind == TK_IDENT) {
         // "("があれば関数呼び出し
-        if (equal(tok->next, "("))
+        if (equal_id(tok + 1, '('))
             return funcall(rest, tok);
         
         // 変数
         Obj *var = find_var(tok);
         if (!var) 
             error_tok(tok, "undefined variable");
-        *rest = tok->next;
+        if (referenced_globals && !var->is_local)
+            hashmap_put(referenced_globals, var->name, var);
+        *rest = tok + 1;
         return new_var_node(var, tok);        
     }
 
     if (tok->kind == TK_STR) {
-        Obj *var = new_string_literal(tok->str, tok->ty);
-        *rest = tok->next;
+        Obj *var = new_string_literal(tok->str->data, array_of(ty_char, tok->str->len));
+        *rest = tok + 1;
         return new_var_node(var, tok);
     }
 
     if (tok->kind == TK_NUM) {
         Node *node = new_num(tok->val, tok);
-        *rest = tok->next;
+        *rest = tok + 1;
         return node;
     }
 
@@ -612,23 +619,27 @@ static Node *primary(Token **rest, Token *tok) {
 static void create_param_lvars(Type *param) {
     if (param) {
         create_param_lvars(param->next);
-        new_lvar(get_ident(param->name), param);
+        new_lvar(get_ident(param->name), param->origin);
     }
 }
 
 // Function = type ident "(" params* ")" "{" compound_stmt
 static Token *function(Token *tok, Type *basety) {
-    Type *ty = declarator(&tok, tok, basety);
+    Token *name;
+    Type *ty = declarator(&tok, tok, basety, &name);
 
-    Obj *fn = new_gvar(get_ident(ty->name), ty);
+    Obj *fn = new_gvar(get_ident(name), ty);
     fn->is_function = true;
+    fn->tok = name;
+    current_fn = fn;
+    unique_id = 0;
 
     locals = NULL;
     enter_scope();
     create_param_lvars(ty->params);
     fn->params = locals;
 
-    tok = skip(tok, "{");
+    tok = skip_id(tok, '{');
     fn->body = compound_stmt(&tok, tok);
     fn->locals = locals;
     leave_scope();
@@ -638,30 +649,76 @@ static Token *function(Token *tok, Type *basety) {
 static Token *global_variable(Token *tok, Type *basety) {
     bool first = true;
 
-    while (!consume(&tok, tok, ";")) {
+    while (!consume_id(&tok, tok, ';')) {
         if (!first)
-            tok = skip(tok, ",");
+            tok = skip_id(tok, ',');
         first = false;
 
-        Type *ty = declarator(&tok, tok, basety);
-        new_gvar(get_ident(ty->name), ty);
+        Token *name;
+        Type *ty = declarator(&tok, tok, basety, &name);
+        new_gvar(get_ident(name), ty)->tok = name;
     }
     return tok;
 }
 
 static bool is_function(Token *tok) {
-    if (equal(tok->next, ";"))
+    if (equal_id(tok + 1, ';'))
         return false;
     
     Type dummy = {};
-    Type *ty = declarator(&tok, tok, &dummy);
+    Token *name;
+    Type *ty = declarator(&tok, tok, &dummy, &name);
     return ty->kind == TY_FUNC;
 }
 
+// tokから関数定義が始まっていればその名前を、そうでなければNULLを返す
+char *function_name(Token *tok) {
+    declspec(&tok, tok);
+    if (!is_function(tok))
+        return NULL;
+
+    Type dummy = {};
+    Token *name;
+    declarator(&tok, tok, &dummy, &name);
+    return get_ident(name);
+}
+
+// 関数定義のうち宣言部分だけを読んで、本体なしの関数を作る。
+// 前回のコンパイル結果を使い回す関数のためのもの
+Obj *declare_function(Token *tok) {
+    Type *basety = declspec(&tok, tok);
+    Token *name;
+    Type *ty = declarator(&tok, tok, basety, &name);
+
+    Obj *fn = new_gvar(get_ident(name), ty);
+    fn->is_function = true;
+    fn->tok = name;
+    return fn;
+}
+
+// Declares a global variable taken from a precompiled header.
+Obj *declare_global(char *name, Type *ty) {
+    return new_gvar(name, ty);
+}
+
 // program = (function-definition | global-variable)*
 Obj *parse(Token *tok) {
+    parse_begin();
+    return parse_toplevel(tok);
+}
+
+// Starts a new translation unit.
+void parse_begin(void) {
     globals = NULL;
+    file_scope = (Scope){};
+    scope = &file_scope;
+    free(visible_vars.buckets);
+    visible_vars = (HashMap){};
+}
 
+// Parses more top-level declarations, adding them to what has been
+// parsed so far. Returns all globals, most recent first.
+Obj *parse_toplevel(Token *tok) {
     while (tok->kind != TK_EOF) {
         Type *basety = declspec(&tok, tok);
 
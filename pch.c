@@ -0,0 +1,500 @@
+// Precompiled headers. "9cc --emit-pch foo.h" preprocesses and parses a
+// header and writes a snapshot of the state it leaves behind to
+// foo.h.pch: the macros, the global variables with their types, and the
+// files it included. A translation unit whose first line includes foo.h
+// takes that state from the snapshot instead of tokenizing,
+// preprocessing and parsing the header again.
+//
+// A snapshot is mmapped and decoded once per process, and kept while
+// the file is unchanged or until a compile server empties the cache. Spellings and string literals are used in
+// place, and identifiers are interned as they are decoded. Types are
+// rebuilt for each translation unit because types belong to a thread.
+//
+// A snapshot is used only if it was written by this build of the
+// compiler and none of the files it was made from has changed: each one
+// is checked by size and mtime, or by its digest if those differ.
+// Otherwise the header is processed as usual.
+//
+// Format (integers are in host byte order):
+//
+//   "9cc-pch\n" <u32 version> <str compiler digest>
+//   <stamp of the header>
+//   <u32 n> n * (<str path> <stamp>)          files it included
+//   <u32 n> n * <macro>
+//   <u32 n> n * (<str name> <type>)           globals, oldest first
+//
+//   str   = <u32 length> <bytes> "\0"
+//   stamp = <u64 size> <i64 mtime sec> <i64 mtime nsec> <str digest>
+//   macro = <str name> <u8 object-like> <u32 n> n * <str param>
+//           <u32 n> n * (<u8 kind> <u8 id> <u8 has_space> <str spelling> [<str data>])
+//   type  = <u8 kind> [<u32 length>] [<type base>]
+#define _DEFAULT_SOURCE
+#include "9cc.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PCH_MAGIC "9cc-pch\n"
+#define PCH_VERSION 2
+
+typedef struct {
+    char *path;
+    off_t size;
+    struct timespec mtime;
+    char *digest;
+} Stamp;
+
+typedef struct Snapshot Snapshot;
+struct Snapshot {
+    Snapshot *next;          // the snapshot loaded before this one
+    char *buf;               // mapping of the file, or NULL
+    off_t size;              // of the snapshot file
+    struct timespec mtime;
+    bool valid;
+
+    Stamp header;
+    Stamp *deps;
+    int ndeps;
+    Macro *macros;
+    int nmacros;
+    char **global_names;
+    char **global_types;     // encoded types, decoded for each use
+    int nglobals;
+};
+
+// Snapshots by path, shared by all threads
+static HashMap snapshots;
+static Snapshot *loaded_snapshots;   // all of them, most recent first
+static size_t snapshot_bytes;        // their mappings
+static Arena pch_arena = {"pch"};
+static pthread_mutex_t pch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//
+// Writer
+//
+
+static void put_u8(FILE *out, uint8_t v) {
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+static void put_u32(FILE *out, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+static void put_u64(FILE *out, uint64_t v) {
+    fwrite(&v, sizeof(v), 1, out);
+}
+
+static void put_str(FILE *out, char *s, int len) {
+    put_u32(out, len);
+    fwrite(s, 1, len, out);
+    put_u8(out, 0);
+}
+
+static void put_stamp(FILE *out, char *path, char *digest) {
+    struct stat st;
+    if (stat(path, &st))
+        error("cannot stat %s: %s", path, strerror(errno));
+    put_u64(out, st.st_size);
+    put_u64(out, st.st_mtim.tv_sec);
+    put_u64(out, st.st_mtim.tv_nsec);
+    put_str(out, digest, strlen(digest));
+}
+
+static void put_type(FILE *out, Type *ty) {
+    put_u8(out, ty->kind);
+    if (ty->kind == TY_ARRAY)
+        put_u32(out, ty->array_len);
+    if (ty->kind == TY_PTR || ty->kind == TY_ARRAY)
+        put_type(out, ty->base);
+}
+
+static void put_macro(FILE *out, Macro *m) {
+    put_str(out, m->name, strlen(m->name));
+    put_u8(out, m->is_objlike);
+    put_u32(out, m->nparams);
+    for (int i = 0; i < m->nparams; i++)
+        put_str(out, m->params[i], strlen(m->params[i]));
+
+    int n = 0;
+    for (Token *tok = m->body; tok->kind != TK_EOF; tok = tok->next)
+        n++;
+    put_u32(out, n);
+
+    for (Token *tok = m->body; tok->kind != TK_EOF; tok = tok->next) {
+        put_u8(out, tok->kind);
+        put_u8(out, tok->id);
+        put_u8(out, tok->has_space);
+        put_str(out, tok->loc, tok->len);
+        if (tok->kind == TK_STR)
+            put_str(out, tok->str->data, tok->str->len);
+    }
+}
+
+static void put_globals(FILE *out, Obj *var) {
+    if (!var)
+        return;
+    put_globals(out, var->next);
+    put_str(out, var->name, strlen(var->name));
+    put_type(out, var->ty);
+}
+
+// Precompiles the header at path into a snapshot at output.
+void write_pch(char *path, char *output) {
+    char *p = read_input(path);
+    parse_begin();
+    Obj *prog = parse_toplevel(preprocess(tokenize_string(path, p)));
+
+    int nglobals = 0;
+    for (Obj *var = prog; var; var = var->next, nglobals++)
+        if (var->is_function)
+            error("%s: cannot precompile a header that defines a function: %s",
+                  path, var->name);
+
+    char *tmp = format("%s.tmp-%d", output, getpid());
+    FILE *out = fopen(tmp, "w");
+    if (!out)
+        error("cannot open %s: %s", tmp, strerror(errno));
+
+    fwrite(PCH_MAGIC, 1, strlen(PCH_MAGIC), out);
+    put_u32(out, PCH_VERSION);
+    char *version = compiler_digest();
+    put_str(out, version, strlen(version));
+    free(version);
+
+    struct stat st;
+    if (stat(path, &st))
+        error("cannot stat %s: %s", path, strerror(errno));
+    char *d = digest(p, st.st_size);
+    put_stamp(out, path, d);
+    free(d);
+
+    // preprocess_deps() gives one "<digest> <path>" line per file.
+    char *deps = preprocess_deps();
+    int ndeps = 0;
+    for (char *q = deps; *q; q++)
+        ndeps += *q == '\n';
+    put_u32(out, ndeps);
+    for (char *line = deps; *line;) {
+        char *nl = strchr(line, '\n');
+        char *sp = strchr(line, ' ');
+        *sp = *nl = '\0';
+        put_str(out, sp + 1, strlen(sp + 1));
+        put_stamp(out, sp + 1, line);
+        line = nl + 1;
+    }
+    free(deps);
+
+    HashMap *macros = macro_table();
+    int nmacros = 0;
+    for (int i = 0; i < macros->capacity; i++)
+        if (macros->buckets[i].key && macros->buckets[i].val)
+            nmacros++;
+    put_u32(out, nmacros);
+    for (int i = 0; i < macros->capacity; i++)
+        if (macros->buckets[i].key && macros->buckets[i].val)
+            put_macro(out, macros->buckets[i].val);
+
+    put_u32(out, nglobals);
+    put_globals(out, prog);
+
+    if (fclose(out) || rename(tmp, output))
+        error("cannot write %s: %s", output, strerror(errno));
+    free(tmp);
+}
+
+//
+// Reader
+//
+
+// Decoding stops at the first malformed or truncated field, and ok
+// tells whether everything read so far was valid.
+typedef struct {
+    char *p;
+    char *end;
+    bool ok;
+} Reader;
+
+static bool need(Reader *r, size_t n) {
+    if (r->ok && r->end - r->p >= n)
+        return true;
+    r->ok = false;
+    return false;
+}
+
+static uint8_t get_u8(Reader *r) {
+    return need(r, 1) ? *r->p++ : 0;
+}
+
+static uint32_t get_u32(Reader *r) {
+    uint32_t v = 0;
+    if (need(r, sizeof(v))) {
+        memcpy(&v, r->p, sizeof(v));
+        r->p += sizeof(v);
+    }
+    return v;
+}
+
+static uint64_t get_u64(Reader *r) {
+    uint64_t v = 0;
+    if (need(r, sizeof(v))) {
+        memcpy(&v, r->p, sizeof(v));
+        r->p += sizeof(v);
+    }
+    return v;
+}
+
+// Returns a string in the mapping, which is NUL-terminated.
+static char *get_str(Reader *r, int *len) {
+    uint32_t n = get_u32(r);
+    if (!need(r, (size_t)n + 1) || r->p[n] != '\0') {
+        r->ok = false;
+        return "";
+    }
+    char *s = r->p;
+    r->p += n + 1;
+    if (len)
+        *len = n;
+    return s;
+}
+
+static Stamp get_stamp(Reader *r) {
+    Stamp s = {};
+    s.size = get_u64(r);
+    s.mtime.tv_sec = get_u64(r);
+    s.mtime.tv_nsec = get_u64(r);
+    s.digest = get_str(r, NULL);
+    return s;
+}
+
+// Checks an encoded type and skips over it.
+static void skip_type(Reader *r, int depth) {
+    int kind = get_u8(r);
+    if (kind == TY_ARRAY)
+        get_u32(r);
+    if (depth > 100 || (kind != TY_CHAR && kind != TY_INT && kind != TY_PTR && kind != TY_ARRAY))
+        r->ok = false;
+    else if (kind == TY_PTR || kind == TY_ARRAY)
+        skip_type(r, depth + 1);
+}
+
+static Type *decode_type(char **p) {
+    int kind = *(*p)++;
+    if (kind == TY_CHAR)
+        return ty_char;
+    if (kind == TY_INT)
+        return ty_int;
+
+    uint32_t len = 0;
+    if (kind == TY_ARRAY) {
+        memcpy(&len, *p, sizeof(len));
+        *p += sizeof(len);
+    }
+    Type *base = decode_type(p);
+    return kind == TY_PTR ? pointer_to(base) : array_of(base, len);
+}
+
+static Token *get_token(Reader *r) {
+    Token *tok = arena_alloc(&pch_arena, sizeof(Token));
+    tok->kind = get_u8(r);
+    tok->id = get_u8(r);
+    tok->has_space = get_u8(r);
+    int len;
+    tok->loc = get_str(r, &len);
+    tok->len = len;
+
+    switch (tok->kind) {
+    case TK_IDENT:
+    case TK_KEYWORD:
+        tok->name = intern(tok->loc, tok->len);
+        break;
+    case TK_NUM:
+        tok->val = strtoul(tok->loc, NULL, 10);
+        break;
+    case TK_STR:
+        tok->str = arena_alloc(&pch_arena, sizeof(StrLiteral));
+        tok->str->data = get_str(r, &tok->str->len);
+        break;
+    case TK_PUNCT:
+        break;
+    default:
+        r->ok = false;
+    }
+    if ((tok->kind == TK_PUNCT || tok->kind == TK_KEYWORD) != (tok->id != 0) ||
+        tok->id >= TOKEN_ID_END)
+        r->ok = false;
+    return tok;
+}
+
+static void get_macro(Reader *r, Macro *m) {
+    int len;
+    char *name = get_str(r, &len);
+    m->name = intern(name, len);
+    m->is_objlike = get_u8(r);
+    m->nparams = get_u32(r);
+    if (!need(r, m->nparams))
+        return;
+
+    m->params = arena_alloc(&pch_arena, sizeof(char *) * m->nparams);
+    for (int i = 0; i < m->nparams; i++) {
+        char *param = get_str(r, &len);
+        m->params[i] = intern(param, len);
+    }
+
+    Token head = {};
+    Token *cur = &head;
+    int n = get_u32(r);
+    for (int i = 0; i < n && r->ok; i++)
+        cur = cur->next = get_token(r);
+    cur->next = arena_alloc(&pch_arena, sizeof(Token));
+    cur->next->kind = TK_EOF;
+    cur->next->loc = "";
+    m->body = head.next;
+}
+
+// Decodes a snapshot. Returns false if it is not one that this
+// compiler wrote.
+static bool decode(Snapshot *s, char *buf, size_t len) {
+    Reader r = {buf, buf + len, true};
+    int magic_len = strlen(PCH_MAGIC);
+    if (!need(&r, magic_len) || memcmp(r.p, PCH_MAGIC, magic_len))
+        return false;
+    r.p += magic_len;
+
+    char *version = compiler_digest();
+    bool same = get_u32(&r) == PCH_VERSION && !strcmp(get_str(&r, NULL), version);
+    free(version);
+    if (!same || !r.ok)
+        return false;
+
+    s->header = get_stamp(&r);
+
+    s->ndeps = get_u32(&r);
+    if (!need(&r, s->ndeps))
+        return false;
+    s->deps = arena_alloc(&pch_arena, sizeof(Stamp) * s->ndeps);
+    for (int i = 0; i < s->ndeps && r.ok; i++) {
+        char *path = get_str(&r, NULL);
+        s->deps[i] = get_stamp(&r);
+        s->deps[i].path = path;
+    }
+
+    s->nmacros = get_u32(&r);
+    if (!need(&r, s->nmacros))
+        return false;
+    s->macros = arena_alloc(&pch_arena, sizeof(Macro) * s->nmacros);
+    for (int i = 0; i < s->nmacros && r.ok; i++)
+        get_macro(&r, &s->macros[i]);
+
+    s->nglobals = get_u32(&r);
+    if (!need(&r, s->nglobals))
+        return false;
+    s->global_names = arena_alloc(&pch_arena, sizeof(char *) * s->nglobals);
+    s->global_types = arena_alloc(&pch_arena, sizeof(char *) * s->nglobals);
+    for (int i = 0; i < s->nglobals && r.ok; i++) {
+        int len;
+        char *name = get_str(&r, &len);
+        s->global_names[i] = intern(name, len);
+        s->global_types[i] = r.p;
+        skip_type(&r, 0);
+    }
+    return r.ok && r.p == r.end;
+}
+
+// Returns the snapshot at path if there is a valid one.
+static Snapshot *load_snapshot(char *path) {
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+
+    pthread_mutex_lock(&pch_lock);
+    Snapshot *s = hashmap_get(&snapshots, path);
+
+    if (!s || s->size != st.st_size || s->mtime.tv_sec != st.st_mtim.tv_sec ||
+        s->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        // Mappings of replaced snapshots are kept, as other threads may
+        // be using their macros.
+        s = arena_alloc(&pch_arena, sizeof(Snapshot));
+        s->next = loaded_snapshots;
+        loaded_snapshots = s;
+        s->size = st.st_size;
+        s->mtime = st.st_mtim;
+
+        int fd = open(path, O_RDONLY);
+        char *buf = fd < 0 ? MAP_FAILED : mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fd >= 0)
+            close(fd);
+        if (buf != MAP_FAILED) {
+            s->buf = buf;
+            snapshot_bytes += st.st_size;
+            s->valid = decode(s, buf, st.st_size);
+        }
+        hashmap_put(&snapshots, intern(path, strlen(path)), s);
+    }
+
+    pthread_mutex_unlock(&pch_lock);
+    return s->valid ? s : NULL;
+}
+
+static bool unchanged(char *path, Stamp *stamp) {
+    struct stat st;
+    if (stat(path, &st))
+        return false;
+    if (st.st_size == stamp->size && st.st_mtim.tv_sec == stamp->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == stamp->mtime.tv_nsec)
+        return true;
+    return file_matches(path, stamp->digest);
+}
+
+// If the header at header_path has an up-to-date snapshot, sets up the
+// preprocessor and parser as if the header had been included, and
+// returns true.
+bool pch_include(char *header_path) {
+    char *path = format("%s.pch", header_path);
+    Snapshot *s = load_snapshot(path);
+    free(path);
+
+    if (!s || !unchanged(header_path, &s->header))
+        return false;
+    for (int i = 0; i < s->ndeps; i++)
+        if (!unchanged(s->deps[i].path, &s->deps[i]))
+            return false;
+
+    add_dependency(intern(header_path, strlen(header_path)), s->header.digest);
+    for (int i = 0; i < s->ndeps; i++)
+        add_dependency(s->deps[i].path, s->deps[i].digest);
+
+    for (int i = 0; i < s->nmacros; i++)
+        define_macro(&s->macros[i]);
+
+    for (int i = 0; i < s->nglobals; i++) {
+        char *p = s->global_types[i];
+        declare_global(s->global_names[i], decode_type(&p));
+    }
+    return true;
+}
+
+// Returns the number of bytes the snapshot cache holds.
+size_t pch_cache_size(void) {
+    pthread_mutex_lock(&pch_lock);
+    size_t size = pch_arena.reserved + snapshot_bytes;
+    pthread_mutex_unlock(&pch_lock);
+    return size;
+}
+
+// Frees all snapshots. The caller makes sure that no thread is
+// compiling.
+void pch_cache_reset(void) {
+    pthread_mutex_lock(&pch_lock);
+    for (Snapshot *s = loaded_snapshots; s; s = s->next)
+        if (s->buf)
+            munmap(s->buf, s->size);
+    free(snapshots.buckets);
+    snapshots = (HashMap){};
+    loaded_snapshots = NULL;
+    snapshot_bytes = 0;
+    arena_release(&pch_arena);
+    pthread_mutex_unlock(&pch_lock);
+}
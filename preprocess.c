@@ -0,0 +1,1146 @@
+// C preprocessor. It runs on the token list between the tokenizer and
+// the parser: directives are executed and removed, and macros are
+// expanded.
+//
+// A header is read and tokenized once per process, or until a compile
+// server empties the cache. Its tokens are kept in a cache shared by all
+// threads, checked against the file's size and mtime, and copied into
+// each translation unit that includes it. Include
+// guards and "#pragma once" are recognized when a header is first read,
+// so including such a header again costs a couple of hash lookups.
+//
+// Macro expansion does not keep hidesets. Instead, a macro is disabled
+// while its replacement is rescanned, and its name is marked noexpand
+// if it turns up then. This gives the standard result except that a
+// function-like macro whose name ends a replacement does not take its
+// arguments from the tokens that follow the invocation.
+#define _DEFAULT_SOURCE
+#include "9cc.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    Token *raw;       // as written, ending with TK_EOF
+    Token *expanded;  // fully expanded, made when first needed
+} MacroArg;
+
+// #if, #ifdef or #ifndef being processed
+typedef struct CondIncl CondIncl;
+struct CondIncl {
+    CondIncl *next;
+    char *loc;       // the directive, for error messages
+    bool in_else;
+    bool included;   // tokens of the current branch are kept
+    bool done;       // no later branch can be taken
+};
+
+// A tokenized header. Headers are kept, even after the file has
+// changed, because other threads may be using the tokens of an old
+// version. They are freed only by header_cache_reset().
+typedef struct Header Header;
+struct Header {
+    Header *next;       // the header loaded before this one
+    char *path;
+    char *contents;
+    size_t mapped;      // length of the mapping of contents, if mapped
+    off_t size;
+    struct timespec mtime;
+    Token *tok;
+    char *digest;       // digest of the file
+    char *guard;        // include guard macro, if any
+    bool pragma_once;
+};
+
+static char **include_paths;
+static int include_path_count;
+
+// See set_include_dirs()
+static _Thread_local bool has_client_dirs;
+static _Thread_local char *client_cwd;
+static _Thread_local char **client_paths;
+static _Thread_local int client_path_count;
+
+static HashMap headers;
+static Header *loaded_headers;   // all of them, most recent first
+static size_t header_bytes;      // their contents
+static Arena header_arena = {"header"};
+static pthread_mutex_t header_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// State of the translation unit being preprocessed. It lives across
+// calls to preprocess_toplevel(), so macros and conditionals work in
+// --stream and --incremental, which preprocess one declaration at a time.
+static _Thread_local HashMap macros;
+static _Thread_local CondIncl *cond_incl;
+static _Thread_local HashMap includes;   // Header by includer and name
+static _Thread_local HashMap included;   // files included so far, by path
+static _Thread_local HashMap deps;       // their digests, by path
+static _Thread_local uint64_t state;     // see preprocess_state()
+static _Thread_local bool at_start;      // nothing has been seen yet
+
+static Token *expand_all(Token *tok);
+
+// Adds a directory to search for #include files, after that of the
+// including file for #include "...".
+void add_include_path(char *dir) {
+    include_paths = realloc(include_paths, sizeof(char *) * (include_path_count + 1));
+    include_paths[include_path_count++] = dir;
+}
+
+// Returns the directories added by add_include_path(), in order.
+char **get_include_paths(int *count) {
+    *count = include_path_count;
+    return include_paths;
+}
+
+// Makes the current thread resolve relative paths against cwd, unless
+// it is NULL, and search paths instead of the directories added by
+// add_include_path(), until reset_include_dirs(). This is how a compile
+// server preprocesses as its client would. The headers it finds then
+// have absolute paths, so clients in different directories do not share
+// cache entries for the same relative name.
+void set_include_dirs(char *cwd, char **paths, int npaths) {
+    has_client_dirs = true;
+    client_cwd = cwd;
+    client_paths = paths;
+    client_path_count = npaths;
+}
+
+void reset_include_dirs(void) {
+    has_client_dirs = false;
+    client_cwd = NULL;
+    client_paths = NULL;
+    client_path_count = 0;
+}
+
+// Returns path, resolved against the directory set by
+// set_include_dirs() if it is relative. Takes ownership of path.
+static char *resolve(char *path) {
+    if (!client_cwd || path[0] == '/')
+        return path;
+    char *abs = format("%s/%s", client_cwd, path);
+    free(path);
+    return abs;
+}
+
+// FNV-1a
+static void update_state(char *p, int len) {
+    for (int i = 0; i < len; i++) {
+        state ^= (unsigned char)p[i];
+        state *= 0x100000001b3;
+    }
+}
+
+static bool is_hash(Token *tok) {
+    return tok->at_bol && equal_id(tok, '#');
+}
+
+static bool is_ident(Token *tok) {
+    return tok->kind == TK_IDENT || tok->kind == TK_KEYWORD;
+}
+
+static Token *copy_token(Token *tok) {
+    Token *t = arena_alloc(&list_arena, sizeof(Token));
+    *t = *tok;
+    t->next = NULL;
+    return t;
+}
+
+static Token *new_eof(Token *tok) {
+    Token *t = copy_token(tok);
+    t->kind = TK_EOF;
+    t->id = 0;
+    t->len = 0;
+    return t;
+}
+
+static Token *last_token(Token *tok) {
+    while (tok->next->kind != TK_EOF)
+        tok = tok->next;
+    return tok;
+}
+
+// Copies tok and the tokens after it into arena, string literals
+// included, up to the end of the line or of the list. The copy ends
+// with TK_EOF.
+static Token *persist(Arena *arena, Token **rest, Token *tok, bool line) {
+    Token head = {};
+    Token *cur = &head;
+
+    for (; tok->kind != TK_EOF && !(line && tok->at_bol); tok = tok->next) {
+        cur = cur->next = arena_alloc(arena, sizeof(Token));
+        *cur = *tok;
+        if (tok->kind == TK_STR) {
+            cur->str = arena_alloc(arena, sizeof(StrLiteral));
+            cur->str->len = tok->str->len;
+            cur->str->data = arena_alloc(arena, tok->str->len);
+            memcpy(cur->str->data, tok->str->data, tok->str->len);
+        }
+    }
+
+    cur = cur->next = arena_alloc(arena, sizeof(Token));
+    *cur = *tok;
+    cur->kind = TK_EOF;
+    cur->id = 0;
+    cur->len = 0;
+    cur->next = NULL;
+    *rest = tok;
+    return head.next;
+}
+
+// Returns the first token of the next line.
+static Token *skip_line(Token *tok) {
+    while (!tok->at_bol && tok->kind != TK_EOF)
+        tok = tok->next;
+    return tok;
+}
+
+// Returns the spelling of a token list, with a space wherever the
+// source had whitespace between two tokens.
+static char *join_tokens(Token *tok, Token *end) {
+    char *buf;
+    size_t len;
+    FILE *out = open_memstream(&buf, &len);
+
+    for (Token *t = tok; t != end && t->kind != TK_EOF; t = t->next) {
+        if (t != tok && t->has_space)
+            fputc(' ', out);
+        fwrite(t->loc, 1, t->len, out);
+    }
+    fclose(out);
+    return buf;
+}
+
+//
+// #if expressions
+//
+
+static long eval_expr(Token **rest, Token *tok, bool live);
+
+static long eval_primary(Token **rest, Token *tok, bool live) {
+    if (equal_id(tok, '(')) {
+        long val = eval_expr(&tok, tok->next, live);
+        *rest = skip_id(tok, ')');
+        return val;
+    }
+
+    if (tok->kind == TK_NUM) {
+        *rest = tok->next;
+        return tok->val;
+    }
+
+    // Identifiers left after macro expansion are 0.
+    if (is_ident(tok)) {
+        *rest = tok->next;
+        return 0;
+    }
+
+    error_tok(tok, "invalid expression in #if");
+    return 0;
+}
+
+static long eval_unary(Token **rest, Token *tok, bool live) {
+    if (equal_id(tok, '+'))
+        return eval_unary(rest, tok->next, live);
+    if (equal_id(tok, '-'))
+        return -eval_unary(rest, tok->next, live);
+    if (equal_id(tok, '!'))
+        return !eval_unary(rest, tok->next, live);
+    if (equal_id(tok, '~'))
+        return ~eval_unary(rest, tok->next, live);
+    return eval_primary(rest, tok, live);
+}
+
+// Precedence of each binary operator, indexed by token ID.
+static int binary_prec(Token *tok) {
+    static int prec[TOKEN_ID_END] = {
+        [P_LOGOR] = 1, [P_LOGAND] = 2, ['|'] = 3, ['^'] = 4, ['&'] = 5,
+        [P_EQ] = 6, [P_NE] = 6, ['<'] = 7, [P_LE] = 7, ['>'] = 7, [P_GE] = 7,
+        [P_SHL] = 8, [P_SHR] = 8, ['+'] = 9, ['-'] = 9, ['*'] = 10, ['/'] = 10, ['%'] = 10,
+    };
+    return tok->kind == TK_PUNCT ? prec[tok->id] : 0;
+}
+
+// Operands that are not evaluated, like the right-hand side of "0 &&",
+// have live set to false, so that dividing by zero there is no error.
+static long eval_binary(Token **rest, Token *tok, int min_prec, bool live) {
+    long lhs = eval_unary(&tok, tok, live);
+
+    for (;;) {
+        int prec = binary_prec(tok);
+        if (prec == 0 || prec < min_prec)
+            break;
+
+        Token *op = tok;
+        bool rhs_live = live;
+        if ((equal_id(op, P_LOGAND) && !lhs) || (equal_id(op, P_LOGOR) && lhs))
+            rhs_live = false;
+        long rhs = eval_binary(&tok, tok->next, prec + 1, rhs_live);
+
+        if ((equal_id(op, '/') || equal_id(op, '%')) && rhs == 0) {
+            if (live)
+                error_tok(op, "division by zero in #if");
+            lhs = 0;
+            continue;
+        }
+
+        switch (op->id) {
+        case P_LOGOR: lhs = lhs || rhs; break;
+        case P_LOGAND: lhs = lhs && rhs; break;
+        case '|': lhs = lhs | rhs; break;
+        case '&': lhs = lhs & rhs; break;
+        case '^': lhs = lhs ^ rhs; break;
+        case P_EQ: lhs = lhs == rhs; break;
+        case P_NE: lhs = lhs != rhs; break;
+        case '<': lhs = lhs < rhs; break;
+        case P_LE: lhs = lhs <= rhs; break;
+        case P_SHL: lhs = lhs << rhs; break;
+        case '>': lhs = lhs > rhs; break;
+        case P_GE: lhs = lhs >= rhs; break;
+        case P_SHR: lhs = lhs >> rhs; break;
+        case '+': lhs = lhs + rhs; break;
+        case '-': lhs = lhs - rhs; break;
+        case '*': lhs = lhs * rhs; break;
+        case '/': lhs = lhs / rhs; break;
+        case '%': lhs = lhs % rhs; break;
+        }
+    }
+
+    *rest = tok;
+    return lhs;
+}
+
+static long eval_expr(Token **rest, Token *tok, bool live) {
+    long cond = eval_binary(&tok, tok, 1, live);
+    if (!equal_id(tok, '?')) {
+        *rest = tok;
+        return cond;
+    }
+
+    long then = eval_expr(&tok, tok->next, live && cond);
+    tok = skip_id(tok, ':');
+    long els = eval_expr(rest, tok, live && !cond);
+    return cond ? then : els;
+}
+
+// Reads the expression of #if or #elif, replacing "defined X" and
+// "defined(X)" before macros are expanded.
+static Token *read_cond_line(Token **rest, Token *tok) {
+    Token head = {};
+    Token *cur = &head;
+
+    while (!tok->at_bol && tok->kind != TK_EOF) {
+        if (!equal(tok, "defined")) {
+            cur = cur->next = copy_token(tok);
+            tok = tok->next;
+            continue;
+        }
+
+        Token *start = tok;
+        bool paren = consume_id(&tok, tok->next, '(');
+        if (!is_ident(tok) || tok->at_bol)
+            error_tok(start, "macro name must be an identifier");
+        bool defined = hashmap_get(&macros, tok->name);
+        tok = tok->next;
+        if (paren)
+            tok = skip_id(tok, ')');
+
+        cur = cur->next = copy_token(start);
+        cur->kind = TK_NUM;
+        cur->id = 0;
+        cur->val = defined;
+    }
+
+    cur->next = new_eof(tok);
+    *rest = tok;
+    return head.next;
+}
+
+static long eval_cond(Token **rest, Token *tok) {
+    Token *start = tok;
+    Token *expr = expand_all(read_cond_line(rest, tok->next));
+    if (expr->kind == TK_EOF)
+        error_tok(start, "no expression");
+
+    long val = eval_expr(&expr, expr, true);
+    if (expr->kind != TK_EOF)
+        error_tok(expr, "extra token");
+    return val;
+}
+
+//
+// Conditional inclusion
+//
+
+static bool skipping(void) {
+    return cond_incl && !cond_incl->included;
+}
+
+static void push_cond(Token *tok, bool cond) {
+    bool outer = !skipping();
+    CondIncl *ci = arena_alloc(&global_arena, sizeof(CondIncl));
+    ci->next = cond_incl;
+    ci->loc = tok->loc;
+    ci->included = outer && cond;
+    ci->done = !outer || cond;
+    cond_incl = ci;
+}
+
+static bool is_defined(Token *tok) {
+    if (!is_ident(tok) || tok->at_bol)
+        error_tok(tok, "macro name must be an identifier");
+    return hashmap_get(&macros, tok->name);
+}
+
+//
+// Macro definitions
+//
+
+static Token *read_define(Token *tok) {
+    if (!is_ident(tok) || tok->at_bol)
+        error_tok(tok, "macro name must be an identifier");
+
+    Macro *m = arena_alloc(&global_arena, sizeof(Macro));
+    m->name = tok->name;
+    tok = tok->next;
+
+    // A function-like macro has "(" right after its name.
+    if (!tok->at_bol && !tok->has_space && equal_id(tok, '(')) {
+        int n = 0;
+        for (Token *p = tok->next; !p->at_bol && p->kind != TK_EOF; p = p->next)
+            n++;
+
+        m->params = arena_alloc(&global_arena, sizeof(char *) * n);
+        tok = tok->next;
+        while (!equal_id(tok, ')')) {
+            if (m->nparams > 0)
+                tok = skip_id(tok, ',');
+            if (!is_ident(tok) || tok->at_bol)
+                error_tok(tok, "expected a parameter name");
+            m->params[m->nparams++] = tok->name;
+            tok = tok->next;
+        }
+        tok = tok->next;
+    } else {
+        m->is_objlike = true;
+    }
+
+    // The definition outlives the tokens of a --stream declaration.
+    m->body = persist(&global_arena, &tok, tok, true);
+    hashmap_put(&macros, m->name, m);
+    return tok;
+}
+
+//
+// Macro expansion
+//
+
+static MacroArg *find_arg(Macro *m, MacroArg *args, Token *tok) {
+    if (!is_ident(tok))
+        return NULL;
+    for (int i = 0; i < m->nparams; i++)
+        if (m->params[i] == tok->name)
+            return &args[i];
+    return NULL;
+}
+
+// Reads the arguments of an invocation of m, from the "(" at tok to the
+// matching ")".
+static MacroArg *read_args(Token **rest, Token *tok, Macro *m) {
+    Token *start = tok;
+    MacroArg *args = arena_alloc(&list_arena, sizeof(MacroArg) * (m->nparams + 1));
+    int n = 0;
+    tok = tok->next;
+
+    if (m->nparams == 0) {
+        *rest = skip_id(tok, ')');
+        return args;
+    }
+
+    for (;;) {
+        Token head = {};
+        Token *cur = &head;
+        int depth = 0;
+
+        while (depth > 0 || !(equal_id(tok, ',') || equal_id(tok, ')'))) {
+            if (tok->kind == TK_EOF)
+                error_tok(start, "unterminated list of macro arguments");
+            if (equal_id(tok, '('))
+                depth++;
+            else if (equal_id(tok, ')'))
+                depth--;
+            cur = cur->next = copy_token(tok);
+            cur->at_bol = false;
+            tok = tok->next;
+        }
+        cur->next = new_eof(tok);
+
+        if (n == m->nparams)
+            error_tok(start, "too many arguments to macro %s", m->name);
+        args[n++].raw = head.next;
+
+        if (equal_id(tok, ')'))
+            break;
+        tok = tok->next;
+    }
+
+    if (n < m->nparams)
+        error_tok(start, "too few arguments to macro %s", m->name);
+    *rest = tok->next;
+    return args;
+}
+
+static Token *copy_list(Token *tok) {
+    Token head = {};
+    Token *cur = &head;
+    for (; tok->kind != TK_EOF; tok = tok->next)
+        cur = cur->next = copy_token(tok);
+    cur->next = new_eof(tok);
+    return head.next;
+}
+
+static Token *expanded_arg(MacroArg *arg) {
+    if (!arg->expanded)
+        arg->expanded = expand_all(copy_list(arg->raw));
+    return arg->expanded;
+}
+
+// Makes a string literal token of the spelling of arg.
+static Token *stringize(Token *hash, Token *arg) {
+    char *s = join_tokens(arg, NULL);
+    int len = strlen(s);
+
+    char *quoted = arena_alloc(&token_arena, len * 2 + 3);
+    char *q = quoted;
+    *q++ = '"';
+    for (char *p = s; *p; p++) {
+        if (*p == '\\' || *p == '"')
+            *q++ = '\\';
+        *q++ = *p;
+    }
+    *q++ = '"';
+
+    Token *tok = copy_token(hash);
+    tok->kind = TK_STR;
+    tok->id = 0;
+    tok->loc = quoted;
+    tok->len = q - quoted;
+    tok->str = arena_alloc(&token_arena, sizeof(StrLiteral));
+    tok->str->data = arena_alloc(&token_arena, len + 1);
+    tok->str->len = len + 1;
+    memcpy(tok->str->data, s, len + 1);
+    free(s);
+    return tok;
+}
+
+// Concatenates two tokens into one.
+static Token *paste(Token *lhs, Token *rhs) {
+    // The newline in front makes the result start a line, like any input
+    // that tokenize_span() is given.
+    int len = lhs->len + rhs->len;
+    char *buf = arena_alloc(&token_arena, len + 3);
+    buf[0] = '\n';
+    memcpy(buf + 1, lhs->loc, lhs->len);
+    memcpy(buf + 1 + lhs->len, rhs->loc, rhs->len);
+    buf[len + 1] = '\n';
+
+    // The result may also be no token at all, like "/" ## "/".
+    Token *tok = tokenize_span(buf + 1, buf + 1 + len);
+    if (tok->kind == TK_EOF || tok->next->kind != TK_EOF)
+        error_tok(lhs, "pasting \"%.*s\" and \"%.*s\" does not give a valid token",
+                  lhs->len, lhs->loc, rhs->len, rhs->loc);
+    tok->at_bol = false;
+    tok->has_space = lhs->has_space;
+    return tok;
+}
+
+// Appends copies of a token list after cur and returns the last one.
+static Token *append(Token *cur, Token *tok) {
+    for (; tok->kind != TK_EOF; tok = tok->next)
+        cur = cur->next = copy_token(tok);
+    return cur;
+}
+
+// Replaces the parameters in the body of m with the arguments.
+static Token *subst(Macro *m, MacroArg *args) {
+    Token head = {};
+    Token *cur = &head;
+    Token *tok = m->body;
+
+    while (tok->kind != TK_EOF) {
+        // "#" followed by a parameter becomes a string literal.
+        if (!m->is_objlike && equal_id(tok, '#')) {
+            MacroArg *arg = find_arg(m, args, tok->next);
+            if (!arg)
+                error_tok(tok->next, "'#' is not followed by a macro parameter");
+            cur = cur->next = stringize(tok, arg->raw);
+            tok = tok->next->next;
+            continue;
+        }
+
+        // The operands of "##" are not macro-expanded.
+        if (equal_id(tok, P_HASHHASH)) {
+            if (cur == &head)
+                error_tok(tok, "'##' cannot appear at either end of macro expansion");
+            if (tok->next->kind == TK_EOF)
+                error_tok(tok, "'##' cannot appear at either end of macro expansion");
+
+            MacroArg *arg = find_arg(m, args, tok->next);
+            if (!arg) {
+                *cur = *paste(cur, tok->next);
+            } else if (arg->raw->kind != TK_EOF) {
+                *cur = *paste(cur, arg->raw);
+                cur = append(cur, arg->raw->next);
+            }
+            tok = tok->next->next;
+            continue;
+        }
+
+        MacroArg *arg = find_arg(m, args, tok);
+
+        if (arg && equal_id(tok->next, P_HASHHASH)) {
+            Token *rhs = tok->next->next;
+
+            // An empty argument disappears together with the "##".
+            if (arg->raw->kind == TK_EOF) {
+                MacroArg *arg2 = find_arg(m, args, rhs);
+                if (arg2)
+                    cur = append(cur, arg2->raw);
+                else if (rhs->kind != TK_EOF)
+                    cur = cur->next = copy_token(rhs);
+                tok = rhs->kind == TK_EOF ? rhs : rhs->next;
+                continue;
+            }
+
+            cur = append(cur, arg->raw);
+            tok = tok->next;
+            continue;
+        }
+
+        if (arg) {
+            Token *exp = expanded_arg(arg);
+            Token *first = cur;
+            cur = append(cur, exp);
+            if (cur != first)
+                first->next->has_space = tok->has_space;
+            tok = tok->next;
+            continue;
+        }
+
+        cur = cur->next = copy_token(tok);
+        tok = tok->next;
+    }
+
+    cur->next = new_eof(tok);
+    return head.next;
+}
+
+// If tok is the name of a macro that can be expanded here, returns its
+// fully expanded replacement, ending with TK_EOF, and sets *rest to the
+// token after the invocation. Otherwise returns NULL.
+static Token *expand(Token **rest, Token *tok) {
+    if (!is_ident(tok) || tok->noexpand || macros.used == 0)
+        return NULL;
+
+    Macro *m = hashmap_get(&macros, tok->name);
+    if (!m)
+        return NULL;
+
+    if (m->disabled) {
+        tok->noexpand = true;
+        return NULL;
+    }
+
+    Token *body;
+    if (m->is_objlike) {
+        body = copy_list(m->body);
+        *rest = tok->next;
+    } else {
+        if (!equal_id(tok->next, '('))
+            return NULL;
+        body = subst(m, read_args(rest, tok->next, m));
+    }
+
+    m->disabled = true;
+    body = expand_all(body);
+    m->disabled = false;
+
+    if (body->kind != TK_EOF) {
+        body->at_bol = false;
+        body->has_space = tok->has_space;
+    }
+    return body;
+}
+
+// Expands all macros in a token list that has no directives.
+static Token *expand_all(Token *tok) {
+    Token head = {};
+    Token *cur = &head;
+
+    while (tok->kind != TK_EOF) {
+        Token *rest;
+        Token *exp = expand(&rest, tok);
+        if (exp) {
+            cur->next = exp;
+            if (exp->kind != TK_EOF)
+                cur = last_token(exp);
+            tok = rest;
+            continue;
+        }
+        cur = cur->next = tok;
+        tok = tok->next;
+    }
+
+    cur->next = tok;
+    return head.next;
+}
+
+//
+// #include
+//
+
+static bool file_exists(char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static char *find_include(char *name, bool quoted, Token *tok) {
+    if (name[0] == '/')
+        return file_exists(name) ? format("%s", name) : NULL;
+
+    if (quoted) {
+        char *file = input_file_name(tok->loc);
+        char *slash = file ? strrchr(file, '/') : NULL;
+        char *path = resolve(slash ? format("%.*s/%s", (int)(slash - file), file, name)
+                                   : format("%s", name));
+        if (file_exists(path))
+            return path;
+        free(path);
+    }
+
+    char **dirs = has_client_dirs ? client_paths : include_paths;
+    int ndirs = has_client_dirs ? client_path_count : include_path_count;
+    for (int i = 0; i < ndirs; i++) {
+        char *path = resolve(format("%s/%s", dirs[i], name));
+        if (file_exists(path))
+            return path;
+        free(path);
+    }
+    return NULL;
+}
+
+// Returns the macro of an include guard, if the header consists of
+// "#ifndef X", "#define X", and the "#endif" that ends the file.
+static char *detect_include_guard(Token *tok) {
+    if (!is_hash(tok) || !equal(tok->next, "ifndef") || !is_ident(tok->next->next))
+        return NULL;
+    char *macro = tok->next->next->name;
+    tok = skip_line(tok->next);
+
+    if (!is_hash(tok) || !equal(tok->next, "define") || !is_ident(tok->next->next) ||
+        tok->next->next->name != macro)
+        return NULL;
+
+    int depth = 0;
+    while (tok->kind != TK_EOF) {
+        if (!is_hash(tok)) {
+            tok = tok->next;
+            continue;
+        }
+
+        Token *dir = tok->next;
+        tok = skip_line(dir);
+        if (equal(dir, "if") || equal(dir, "ifdef") || equal(dir, "ifndef"))
+            depth++;
+        else if (equal(dir, "endif") && depth-- == 0)
+            return tok->kind == TK_EOF ? macro : NULL;
+    }
+    return NULL;
+}
+
+static bool has_pragma_once(Token *tok) {
+    for (; tok->kind != TK_EOF; tok = tok->next)
+        if (is_hash(tok) && equal(tok->next, "pragma") && equal(tok->next->next, "once"))
+            return true;
+    return false;
+}
+
+// Returns the header at path, tokenizing it unless the cache has an
+// up-to-date copy.
+static Header *load_header(char *path) {
+    struct stat st;
+    if (stat(path, &st))
+        return NULL;
+
+    pthread_mutex_lock(&header_lock);
+    Header *h = hashmap_get(&headers, path);
+    pthread_mutex_unlock(&header_lock);
+
+    if (h && h->size == st.st_size && h->mtime.tv_sec == st.st_mtim.tv_sec &&
+        h->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return h;
+
+    // Tokenize without holding the lock: an error in the header ends
+    // only this compilation.
+    char *name = intern(path, strlen(path));
+    size_t mapped;
+    char *contents = read_file2(name, &mapped);
+    Token *tok = tokenize_include(name, contents);
+
+    pthread_mutex_lock(&header_lock);
+    h = arena_alloc(&header_arena, sizeof(Header));
+    h->next = loaded_headers;
+    loaded_headers = h;
+    h->path = name;
+    h->contents = contents;
+    h->mapped = mapped;
+    h->size = st.st_size;
+    h->mtime = st.st_mtim;
+    h->tok = persist(&header_arena, &tok, tok, false);
+    h->digest = digest(contents, st.st_size);
+    h->guard = detect_include_guard(h->tok);
+    h->pragma_once = has_pragma_once(h->tok);
+    hashmap_put(&headers, name, h);
+    header_bytes += st.st_size;
+    pthread_mutex_unlock(&header_lock);
+    return h;
+}
+
+// Returns the number of bytes the header cache holds.
+size_t header_cache_size(void) {
+    pthread_mutex_lock(&header_lock);
+    size_t size = header_arena.reserved + header_bytes;
+    pthread_mutex_unlock(&header_lock);
+    return size;
+}
+
+// Frees all headers. The caller makes sure that no thread is
+// preprocessing.
+void header_cache_reset(void) {
+    pthread_mutex_lock(&header_lock);
+    for (Header *h = loaded_headers; h; h = h->next) {
+        if (h->mapped)
+            munmap(h->contents, h->mapped);
+        else
+            free(h->contents);
+        free(h->digest);
+    }
+    free(headers.buckets);
+    headers = (HashMap){};
+    loaded_headers = NULL;
+    header_bytes = 0;
+    arena_release(&header_arena);
+    pthread_mutex_unlock(&header_lock);
+}
+
+// Executes "#include" at tok and returns the tokens of the file
+// followed by those after the directive.
+static Token *include_file(Token *tok) {
+    Token *start = tok;
+    char *name;
+    bool quoted = tok->next->kind == TK_STR && !tok->next->at_bol;
+
+    if (quoted) {
+        name = format("%s", tok->next->str->data);
+        tok = tok->next->next;
+    } else if (equal_id(tok->next, '<') && !tok->next->at_bol) {
+        Token *end = tok->next->next;
+        while (!equal_id(end, '>')) {
+            if (end->at_bol || end->kind == TK_EOF)
+                error_tok(tok->next, "expected '>'");
+            end = end->next;
+        }
+        name = join_tokens(tok->next->next, end);
+        tok = end->next;
+    } else {
+        error_tok(tok, "expected a filename");
+    }
+
+    Token *rest = skip_line(tok);
+
+    // Where a name leads is looked up once per including file, so a
+    // header that is included again needs neither a stat() nor the lock.
+    char *includer = input_file_name(start->loc);
+    char *key = format("%s\n%s", includer ? includer : "", name);
+    Header *h = hashmap_get(&includes, key);
+
+    if (!h) {
+        char *path = find_include(name, quoted, start);
+        if (!path)
+            error_tok(start, "%s: cannot open file", name);
+
+        // A translation unit that starts with a precompiled header
+        // takes its state from the snapshot.
+        if (at_start && pch_include(path)) {
+            free(path);
+            free(key);
+            free(name);
+            return rest;
+        }
+
+        h = load_header(path);
+        if (!h)
+            error_tok(start, "%s: cannot open file", name);
+        free(path);
+
+        char *copy = arena_alloc(&global_arena, strlen(key) + 1);
+        hashmap_put(&includes, strcpy(copy, key), h);
+    }
+    free(key);
+    free(name);
+
+    if (hashmap_get(&included, h->path) &&
+        (h->pragma_once || (h->guard && hashmap_get(&macros, h->guard))))
+        return rest;
+
+    add_dependency(h->path, h->digest);
+    add_input_file(h->path, h->contents);
+
+    Token head = {};
+    Token *cur = &head;
+    for (Token *t = h->tok; t->kind != TK_EOF; t = t->next)
+        cur = cur->next = copy_token(t);
+    cur->next = rest;
+    return head.next;
+}
+
+// Records that the translation unit has included the file at path,
+// whose digest is given. path must outlive the translation unit.
+void add_dependency(char *path, char *digest) {
+    hashmap_put(&included, path, (void *)1);
+    hashmap_put(&deps, path, digest);
+    update_state(digest, strlen(digest));
+}
+
+//
+// Directives
+//
+
+// Executes the directive starting with "#" at hash and returns the
+// token after it.
+static Token *directive(Token *hash) {
+    Token *tok = hash->next;
+
+    for (Token *t = hash; t == hash || (!t->at_bol && t->kind != TK_EOF); t = t->next) {
+        update_state(t->loc, t->len);
+        update_state(" ", 1);
+    }
+    update_state("\n", 1);
+
+    // Null directive
+    if (tok->at_bol || tok->kind == TK_EOF)
+        return tok;
+
+    // Conditionals are followed even in skipped blocks.
+    if (equal(tok, "if")) {
+        bool cond = skipping() ? false : eval_cond(&tok, tok);
+        push_cond(hash, cond);
+        return skip_line(tok);
+    }
+
+    if (equal(tok, "ifdef") || equal(tok, "ifndef")) {
+        bool cond = skipping() ? false : is_defined(tok->next) == equal(tok, "ifdef");
+        push_cond(hash, cond);
+        return skip_line(tok->next);
+    }
+
+    if (equal(tok, "elif")) {
+        if (!cond_incl || cond_incl->in_else)
+            error_tok(tok, "stray #elif");
+        if (cond_incl->done) {
+            cond_incl->included = false;
+            return skip_line(tok);
+        }
+        bool cond = eval_cond(&tok, tok);
+        cond_incl->included = cond;
+        cond_incl->done = cond;
+        return skip_line(tok);
+    }
+
+    if (equal(tok, "else")) {
+        if (!cond_incl || cond_incl->in_else)
+            error_tok(tok, "stray #else");
+        cond_incl->in_else = true;
+        cond_incl->included = !cond_incl->done;
+        cond_incl->done = true;
+        return skip_line(tok->next);
+    }
+
+    if (equal(tok, "endif")) {
+        if (!cond_incl)
+            error_tok(tok, "stray #endif");
+        cond_incl = cond_incl->next;
+        return skip_line(tok->next);
+    }
+
+    if (skipping())
+        return skip_line(tok);
+
+    if (equal(tok, "include"))
+        return include_file(tok);
+
+    if (equal(tok, "define"))
+        return read_define(tok->next);
+
+    // The entry is kept, so that the table has only defined macros
+    // with a non-NULL value.
+    if (equal(tok, "undef")) {
+        if (!is_ident(tok->next) || tok->next->at_bol)
+            error_tok(tok->next, "macro name must be an identifier");
+        if (hashmap_get(&macros, tok->next->name))
+            hashmap_put(&macros, tok->next->name, NULL);
+        return skip_line(tok->next);
+    }
+
+    // "#pragma once" is found when the header is read; other pragmas
+    // are ignored.
+    if (equal(tok, "pragma"))
+        return skip_line(tok);
+
+    if (equal(tok, "error"))
+        error_tok(tok, "#error");
+
+    error_tok(tok, "invalid preprocessor directive");
+    return NULL;
+}
+
+//
+// Entry points
+//
+
+// Starts a new translation unit.
+void preprocess_begin(void) {
+    free(macros.buckets);
+    free(includes.buckets);
+    free(included.buckets);
+    free(deps.buckets);
+    macros = includes = included = deps = (HashMap){};
+    cond_incl = NULL;
+    state = 0xcbf29ce484222325;
+    at_start = true;
+}
+
+// Adds a macro taken from a precompiled header.
+void define_macro(Macro *m) {
+    Macro *copy = arena_alloc(&global_arena, sizeof(Macro));
+    *copy = *m;
+    hashmap_put(&macros, copy->name, copy);
+}
+
+// Returns the macros defined so far, by name. Undefined ones are NULL.
+HashMap *macro_table(void) {
+    return &macros;
+}
+
+// The output of preprocess_toplevel(), copied into one growing array.
+static _Thread_local Token *out;
+static _Thread_local int out_len;
+static _Thread_local int out_cap;
+
+static void out_push(Token *tok) {
+    if (out_len == out_cap) {
+        out_cap = out_cap ? out_cap * 2 : 4096;
+        out = array_grow(out, sizeof(Token) * out_cap);
+    }
+    out[out_len++] = *tok;
+}
+
+// Ends the output with eof and hands it over to token_arena. next still
+// links the tokens, for the code that walks token lists.
+static Token *pack(Token *eof) {
+    out_push(eof);
+    for (int i = 0; i < out_len - 1; i++)
+        out[i].next = &out[i + 1];
+    out[out_len - 1].next = NULL;
+
+    Token *arr = out;
+    arena_adopt(&token_arena, out, sizeof(Token) * out_len);
+    out = NULL;
+    out_len = out_cap = 0;
+    return arr;
+}
+
+// Returns the tokens of tok and then of tok2, both returned by
+// preprocess_toplevel(), as one array.
+Token *concat_tokens(Token *tok, Token *tok2) {
+    out_len = 0;
+    for (; tok->kind != TK_EOF; tok = tok->next)
+        out_push(tok);
+    for (; tok2->kind != TK_EOF; tok2 = tok2->next)
+        out_push(tok2);
+    return pack(tok2);
+}
+
+// Preprocesses the next part of the translation unit, which must not
+// end in the middle of a directive or a macro invocation. The result is
+// an array ending with TK_EOF, so that the parser can look ahead by
+// index. The token lists it was made from, tok included, are freed.
+Token *preprocess_toplevel(Token *tok) {
+    // An error may have left tokens behind.
+    out_len = 0;
+
+    while (tok->kind != TK_EOF) {
+        if (is_hash(tok)) {
+            tok = directive(tok);
+            at_start = false;
+            continue;
+        }
+
+        if (skipping()) {
+            tok = tok->next;
+            continue;
+        }
+
+        at_start = false;
+        Token *rest;
+        Token *exp = expand(&rest, tok);
+        if (exp) {
+            for (; exp->kind != TK_EOF; exp = exp->next)
+                out_push(exp);
+            tok = rest;
+            continue;
+        }
+
+        out_push(tok);
+        tok = tok->next;
+    }
+
+    Token *arr = pack(tok);
+    arena_release(&list_arena);
+    return arr;
+}
+
+// Ends the translation unit.
+void preprocess_end(void) {
+    if (cond_incl)
+        error_at(cond_incl->loc, "unterminated conditional directive");
+}
+
+Token *preprocess(Token *tok) {
+    preprocess_begin();
+    tok = preprocess_toplevel(tok);
+    preprocess_end();
+    return tok;
+}
+
+// Returns a hash of everything so far in the translation unit that can
+// change the meaning of the tokens after it: the text of the directives
+// and the contents of the included files.
+uint64_t preprocess_state(void) {
+    return state;
+}
+
+// Returns the files included by the translation unit, one
+// "<digest> <path>" line each.
+char *preprocess_deps(void) {
+    char *buf;
+    size_t len;
+    FILE *out = open_memstream(&buf, &len);
+
+    for (int i = 0; i < deps.capacity; i++)
+        if (deps.buckets[i].key)
+            fprintf(out, "%s %s\n", (char *)deps.buckets[i].val, deps.buckets[i].key);
+    fclose(out);
+    return buf;
+}
@@ -0,0 +1,259 @@
+// Compile server. "9cc --server <socket>" keeps one process running
+// that compiles sources sent to it over a Unix domain socket, so that a
+// build does not pay for process startup and table initialization for
+// every file. "9cc --connect <socket> ..." is a client that takes the
+// usual command line and has the server do the compiling.
+//
+// A connection carries a single request: the input's file name, the
+// client's working directory, its include paths and the input's
+// contents. The server resolves #include as the client would, against
+// that directory and those paths. The reply is the status returned by
+// compile(), the assembly and the diagnostics. Strings are sent as a
+// 64-bit length followed by that many bytes. The include paths are one
+// string, each path terminated by a NUL.
+//
+// Everything a request allocates is freed when it is done, except what
+// requests share: the intern pool and the caches of headers and
+// precompiled headers. Those are kept across requests, as reusing them
+// is much of the point of a server, but they only grow, so once they
+// hold more than --server-memory they are emptied between requests.
+#define _GNU_SOURCE
+#include "9cc.h"
+#include "lib9cc.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Requests larger than this are rejected.
+#define MAX_MESSAGE (1ULL << 32)
+
+size_t opt_server_memory = 256 * 1024 * 1024;
+
+static bool write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool send_string(int fd, const char *s, uint64_t len) {
+    return write_all(fd, &len, sizeof(len)) && write_all(fd, s, len);
+}
+
+// Receives a string sent by send_string(). The result is NUL-terminated
+// and owned by the caller. Returns NULL if the connection is broken.
+static char *recv_string(int fd, uint64_t *len) {
+    if (!read_all(fd, len, sizeof(*len)) || *len >= MAX_MESSAGE)
+        return NULL;
+
+    char *s = malloc(*len + 1);
+    if (!s || !read_all(fd, s, *len)) {
+        free(s);
+        return NULL;
+    }
+    s[*len] = '\0';
+    return s;
+}
+
+static struct sockaddr_un socket_addr(char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        error("socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+//
+// Server
+//
+
+static int listen_fd;
+
+// Held for reading while a request is compiled and for writing while
+// the shared memory is freed. Writers are preferred so that a steady
+// stream of requests cannot put that off forever.
+static pthread_rwlock_t shared_lock;
+
+static size_t shared_size(void) {
+    return intern_size() + header_cache_size() + pch_cache_size();
+}
+
+static void release_shared(void) {
+    pthread_rwlock_wrlock(&shared_lock);
+
+    // Another worker may have done it while this one was waiting.
+    if (shared_size() > opt_server_memory) {
+        pch_cache_reset();
+        header_cache_reset();
+        intern_reset();
+    }
+    pthread_rwlock_unlock(&shared_lock);
+}
+
+// Splits the include paths sent by compile_remote() in place.
+static char **split_paths(char *buf, uint64_t len, int *count) {
+    char **paths = NULL;
+    *count = 0;
+    for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+        paths = realloc(paths, sizeof(char *) * (*count + 1));
+        paths[(*count)++] = p;
+    }
+    return paths;
+}
+
+static void serve_request(int fd, CompileContext *ctx) {
+    uint64_t name_len, dir_len, paths_len, src_len;
+    char *name = recv_string(fd, &name_len);
+    char *dir = name ? recv_string(fd, &dir_len) : NULL;
+    char *paths = dir ? recv_string(fd, &paths_len) : NULL;
+    char *src = paths ? recv_string(fd, &src_len) : NULL;
+
+    // compile() releases everything the request allocated, so a worker
+    // starts each request with empty arenas.
+    if (src) {
+        ctx->filename = name;
+        ctx->dir = dir;
+        ctx->include_paths = split_paths(paths, paths_len, &ctx->include_path_count);
+        pthread_rwlock_rdlock(&shared_lock);
+        int32_t status = compile(ctx, src, src_len);
+        pthread_rwlock_unlock(&shared_lock);
+        if (write_all(fd, &status, sizeof(status)) &&
+            send_string(fd, ctx->asm_text ? ctx->asm_text : "", ctx->asm_len))
+            send_string(fd, ctx->diag, ctx->diag_len);
+        compile_context_free(ctx);
+        free(ctx->include_paths);
+        ctx->include_paths = NULL;
+    }
+
+    free(name);
+    free(dir);
+    free(paths);
+    free(src);
+    close(fd);
+}
+
+static void *server_worker(void *arg) {
+    CompileContext ctx = {};
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd >= 0)
+            serve_request(fd, &ctx);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            error("accept: %s", strerror(errno));
+
+        if (shared_size() > opt_server_memory)
+            release_shared();
+    }
+    return NULL;
+}
+
+// Serves requests on socket_path until the process is killed. Up to
+// opt_jobs requests are compiled at the same time, each on one thread.
+void serve(char *socket_path) {
+    struct sockaddr_un addr = socket_addr(socket_path);
+
+    // Remove a socket left behind by a previous server, but nothing else.
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(listen_fd, SOMAXCONN))
+        error("cannot listen on %s: %s", socket_path, strerror(errno));
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&shared_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    int nthreads = opt_jobs;
+    opt_jobs = 1;
+
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t thr;
+        if (pthread_create(&thr, NULL, server_worker, NULL))
+            error("cannot create a thread");
+    }
+    server_worker(NULL);
+}
+
+//
+// Client
+//
+
+// Has the server at socket_path compile src, the contents of path.
+// Returns the assembly and sets its length to *len. Diagnostics are
+// printed to stderr, and the process exits if the file has an error,
+// just as when compiling locally.
+char *compile_remote(char *socket_path, char *path, char *src, size_t *len) {
+    struct sockaddr_un addr = socket_addr(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        error("cannot connect to %s: %s", socket_path, strerror(errno));
+
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd)
+        error("getcwd: %s", strerror(errno));
+
+    char *paths;
+    size_t paths_len;
+    FILE *out = open_memstream(&paths, &paths_len);
+    int n;
+    char **dirs = get_include_paths(&n);
+    for (int i = 0; i < n; i++)
+        fwrite(dirs[i], 1, strlen(dirs[i]) + 1, out);
+    fclose(out);
+
+    int32_t status;
+    uint64_t asm_len, diag_len;
+    char *asm_text = NULL;
+    char *diag = NULL;
+
+    if (!send_string(fd, path, strlen(path)) ||
+        !send_string(fd, cwd, strlen(cwd)) ||
+        !send_string(fd, paths, paths_len) ||
+        !send_string(fd, src, strlen(src)) ||
+        !read_all(fd, &status, sizeof(status)) ||
+        !(asm_text = recv_string(fd, &asm_len)) ||
+        !(diag = recv_string(fd, &diag_len)))
+        error("%s: lost connection to the server", socket_path);
+    close(fd);
+    free(cwd);
+    free(paths);
+
+    fwrite(diag, 1, diag_len, stderr);
+    free(diag);
+    if (status)
+        exit(1);
+
+    *len = asm_len;
+    return asm_text;
+}
@@ -1,4 +1,5 @@
 #include "9cc.h"
+#include <pthread.h>
 
 // Takes a printf-style format string and returns a formatted string.
 char *format(char *fmt, ...) {
@@ -12,4 +13,73 @@ char *format(char *fmt, ...) {
     va_end(ap);
     fclose(out);
     return buf;
-}
\ No newline at end of file
+}
+
+// The intern pool is split into shards with their own locks so that
+// tokenizer threads can intern identifiers concurrently.
+#define NSHARDS 64
+
+static struct {
+    pthread_mutex_t mu;
+    HashMap map;
+    size_t bytes;   // of the strings in map
+} shards[NSHARDS];
+
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void) {
+    for (int i = 0; i < NSHARDS; i++)
+        pthread_mutex_init(&shards[i].mu, NULL);
+}
+
+// Returns the canonical copy of s[0..len). Equal strings are interned
+// to the same pointer, so they can be compared with ==.
+char *intern(char *s, int len) {
+    pthread_once(&shards_once, init_shards);
+
+    unsigned h = len ? len * 31 + (unsigned char)s[0] * 7 + (unsigned char)s[len - 1] : 0;
+    HashMap *map = &shards[h % NSHARDS].map;
+    pthread_mutex_t *mu = &shards[h % NSHARDS].mu;
+
+    pthread_mutex_lock(mu);
+    char *str = hashmap_get2(map, s, len);
+    if (!str) {
+        str = strndup(s, len);
+        hashmap_put2(map, str, len, str);
+        shards[h % NSHARDS].bytes += len + 1;
+    }
+    pthread_mutex_unlock(mu);
+    return str;
+}
+
+// Returns the number of bytes the intern pool holds.
+size_t intern_size(void) {
+    pthread_once(&shards_once, init_shards);
+
+    size_t size = 0;
+    for (int i = 0; i < NSHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mu);
+        size += shards[i].bytes + sizeof(HashEntry) * shards[i].map.capacity;
+        pthread_mutex_unlock(&shards[i].mu);
+    }
+    return size;
+}
+
+// Frees every interned string. The caller makes sure that nothing
+// refers to them any more.
+void intern_reset(void) {
+    pthread_once(&shards_once, init_shards);
+
+    for (int i = 0; i < NSHARDS; i++) {
+        pthread_mutex_lock(&shards[i].mu);
+        // Nothing is ever deleted from the pool, so there are no
+        // tombstones.
+        HashMap *map = &shards[i].map;
+        for (int j = 0; j < map->capacity; j++)
+            free(map->buckets[j].key);
+        free(map->buckets);
+        *map = (HashMap){};
+        shards[i].bytes = 0;
+        pthread_mutex_unlock(&shards[i].mu);
+    }
+}
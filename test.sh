@@ -13,15 +13,34 @@ assert() {
     expected="$1"
     input="$2"
     
-    echo "$input" | ./9cc -o tmp.s - || exit
-    cc -o tmp tmp.s tmp2.o
+    echo "$input" | ./9cc --link -o tmp - tmp2.o || exit
     ./tmp
     actual="$?"
 
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected, but got $actual"
+        exit 1
+    fi
+
+    # The same through the integrated assembler
+    echo "$input" | ./9cc -c -o tmp.o - || exit
+    cc -o tmp tmp.o tmp2.o
+    ./tmp
+    actual="$?"
+
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected with -c, but got $actual"
+        exit 1
+    fi
+
+    # And in memory
+    echo "$input" | ./9cc --run - tmp2.o
+    actual="$?"
+
     if [ "$actual" = "$expected" ]; then
         echo "$input => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
+        echo "$input => $expected expected with --run, but got $actual"
         exit 1
     fi
 }
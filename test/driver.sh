@@ -22,4 +22,438 @@ check -o
 ./9cc --help 2>&1 | grep -q 9cc
 check --help
 
+# --stats
+./9cc --stats -o $tmp/out $tmp/empty.c 2>&1 | grep -q 'ast arena'
+check --stats
+
+# input files with and without a trailing newline
+echo 'int main() { return 3; } // c' > $tmp/nl.c
+printf 'int main() { return 3; } // c' > $tmp/nonl.c
+./9cc -o $tmp/nl.s $tmp/nl.c && ./9cc -o $tmp/nonl.s $tmp/nonl.c &&
+  cmp -s $tmp/nl.s $tmp/nonl.s
+check 'file input'
+
+# -j: chunked tokenization must not change the output
+{
+  echo 'int main() { int x; char *s; x = 0;'
+  yes '  x = x + 1; // "comment
+  s = "// \" /*"; /* "block"
+  */ x = x - s[0];' | head -n 60000
+  echo '  return x; }'
+} > $tmp/big.c
+./9cc -o $tmp/big1.s $tmp/big.c && ./9cc -j 4 -o $tmp/big4.s $tmp/big.c &&
+  cmp -s $tmp/big1.s $tmp/big4.s
+check -j
+
+# -j: every line break is inside a macro argument, so every chunk starts
+# with whitespace that # must turn into a space
+{
+  echo '#define S(x) #x'
+  echo 'int main() { return sizeof(S(a'
+  yes 'b)) - sizeof(S(a' | head -n 70000
+  echo 'b)); }'
+} > $tmp/str.c
+./9cc -o $tmp/str1.s $tmp/str.c && ./9cc -j 4 -o $tmp/str4.s $tmp/str.c &&
+  cmp -s $tmp/str1.s $tmp/str4.s
+check '-j with # across chunks'
+
+# -j: functions generated on worker threads are written in order
+cc -o- -E -P -C test/function.c > $tmp/fn.c
+./9cc -o $tmp/fn1.s $tmp/fn.c && ./9cc -j 4 -o $tmp/fn4.s $tmp/fn.c &&
+  cmp -s $tmp/fn1.s $tmp/fn4.s
+check '-j codegen'
+
+# --cache
+./9cc --cache $tmp/cache --cache-stats -o $tmp/cache1.s $tmp/fn.c 2>&1 | grep -q '0 hits, 1 misses' &&
+  ./9cc --cache $tmp/cache --cache-stats -o $tmp/cache2.s $tmp/fn.c 2>&1 | grep -q '1 hits, 0 misses' &&
+  cmp -s $tmp/fn1.s $tmp/cache1.s && cmp -s $tmp/fn1.s $tmp/cache2.s
+check --cache
+
+./9cc --cache $tmp/cache --stream -o $tmp/cache3.s $tmp/fn.c &&
+  ./9cc --stream -o $tmp/stream.s $tmp/fn.c && cmp -s $tmp/stream.s $tmp/cache3.s
+check '--cache with --stream'
+
+./9cc --cache $tmp/cache --cache-size 0 -o $tmp/cache4.s $tmp/big.c &&
+  cmp -s $tmp/big1.s $tmp/cache4.s && [ -z "$(ls $tmp/cache)" ]
+check '--cache-size'
+
+# preprocessor
+mkdir -p $tmp/pp/inc
+cat > $tmp/pp/guard.h <<'EOF'
+// guarded
+#ifndef GUARD_H
+#define GUARD_H
+int twice(int x) { return x + x; }
+#endif
+EOF
+cat > $tmp/pp/inc/once.h <<'EOF'
+#pragma once
+int thrice(int x) { return x * 3; }
+EOF
+cat > $tmp/pp/pp.c <<'EOF'
+#include "guard.h"
+#include "guard.h"
+#include <once.h>
+#include "inc/once.h"
+#define ONE 1
+#define ADD(x, y) ((x) + (y))
+#define CAT(x, y) x ## y
+#define STR(x) #x
+#define LONG_MACRO(x) \
+  ADD(x, \
+      ONE)
+int main() {
+  int a;
+  int xy;
+#if defined(ONE) && ADD(ONE, 2) == 3 && !defined NONE
+  a = ONE;
+#elif 1
+  a = 100;
+#else
+  a = 200;
+#endif
+#ifdef NONE
+#error not reached
+#endif
+  CAT(x, y) = 4;
+  return a + xy + STR(a "\n" b)[2] - 34 + LONG_MACRO(1) + twice(3) + thrice(1);
+}
+EOF
+./9cc -I $tmp/pp/inc -o $tmp/pp.s $tmp/pp/pp.c &&
+  cc -o $tmp/pp.exe $tmp/pp.s -xc test/common && { $tmp/pp.exe; [ $? = 16 ]; }
+check preprocessor
+
+./9cc -I $tmp/pp/inc --stream -o $tmp/pp-stream.s $tmp/pp/pp.c && cmp -s $tmp/pp.s $tmp/pp-stream.s
+check 'preprocessor with --stream'
+
+printf '#define X 1\n\nint f() { return y; }\n' > $tmp/pp/bad.h
+echo '#include "bad.h"' > $tmp/pp/bad.c
+./9cc -o $tmp/out $tmp/pp/bad.c 2>&1 | grep -q 'bad.h:3:'
+check 'error in a header'
+
+printf '#define P(a, b) a ## b\nint main() { return 1 P(/, /) 2; }\n' > $tmp/pp/paste.c
+./9cc -o $tmp/out $tmp/pp/paste.c 2>&1 | grep -q 'does not give a valid token'
+check 'pasting into a comment'
+
+echo '#define V 1' > $tmp/pp/v.h
+printf '#include "v.h"\nint main() { return V; }\n' > $tmp/pp/v.c
+./9cc --cache $tmp/pp-cache -o $tmp/v1.s $tmp/pp/v.c &&
+  echo '#define V 2' > $tmp/pp/v.h &&
+  ./9cc --cache $tmp/pp-cache --cache-stats -o $tmp/v2.s $tmp/pp/v.c 2>&1 | grep -q '0 hits' &&
+  ./9cc --cache $tmp/pp-cache --cache-stats -o $tmp/v3.s $tmp/pp/v.c 2>&1 | grep -q '1 hits' &&
+  ! cmp -s $tmp/v1.s $tmp/v2.s && cmp -s $tmp/v2.s $tmp/v3.s
+check '--cache with a changed header'
+
+mkdir -p $tmp/pp/ia $tmp/pp/ib
+echo '#define W 1' > $tmp/pp/ia/w.h
+echo '#define W 2' > $tmp/pp/ib/w.h
+printf '#include <w.h>\nint main() { return W; }\n' > $tmp/pp/w.c
+./9cc --cache $tmp/pp-cache -I $tmp/pp/ia -o $tmp/wa.s $tmp/pp/w.c &&
+  ./9cc --cache $tmp/pp-cache -I $tmp/pp/ib -o $tmp/wb.s $tmp/pp/w.c &&
+  ./9cc -I $tmp/pp/ib -o $tmp/w.s $tmp/pp/w.c && cmp -s $tmp/wb.s $tmp/w.s &&
+  ! cmp -s $tmp/wa.s $tmp/wb.s
+check '--cache with other include paths'
+
+# --emit-pch
+cat > $tmp/pp/decls.h <<'EOF'
+#ifndef DECLS_H
+#define DECLS_H
+#include "v.h"
+#define SQUARE(x) ((x) * (x))
+#define MSG "hello"
+int counter;
+char *names[4];
+int grid[3][2];
+#endif
+EOF
+cat > $tmp/pp/pch.c <<'EOF'
+#include "decls.h"
+int main() { counter = SQUARE(V); grid[1][1] = MSG[1]; return counter + grid[1][1] - 97; }
+EOF
+./9cc -o $tmp/nopch.s $tmp/pp/pch.c && ./9cc --emit-pch $tmp/pp/decls.h &&
+  [ -f $tmp/pp/decls.h.pch ] && ./9cc -o $tmp/pch.s $tmp/pp/pch.c && cmp -s $tmp/nopch.s $tmp/pch.s &&
+  cc -o $tmp/pch.exe $tmp/pch.s -xc test/common && { $tmp/pch.exe; [ $? = 8 ]; }
+check --emit-pch
+
+# a snapshot is not used once its header has changed
+cp $tmp/pp/decls.h $tmp/pp/decls.bak
+sed -i 's/int counter;/int countex;/' $tmp/pp/decls.h
+./9cc -o $tmp/out $tmp/pp/pch.c 2>&1 | grep -q 'undefined variable'
+check '--emit-pch with a changed header'
+cp $tmp/pp/decls.bak $tmp/pp/decls.h
+
+echo '#define V 3' > $tmp/pp/v.h
+./9cc -o $tmp/pch2.s $tmp/pp/pch.c && ./9cc --emit-pch $tmp/pp/decls.h -o $tmp/pp/decls.h.pch &&
+  ! cmp -s $tmp/pch.s $tmp/pch2.s && ./9cc -o $tmp/pch3.s $tmp/pp/pch.c && cmp -s $tmp/pch2.s $tmp/pch3.s
+check '--emit-pch with a changed dependency'
+
+head -c 100 $tmp/pp/decls.h.pch > $tmp/pp/decls.h.tmp && mv $tmp/pp/decls.h.tmp $tmp/pp/decls.h.pch &&
+  ./9cc -o $tmp/pch4.s $tmp/pp/pch.c && cmp -s $tmp/pch2.s $tmp/pch4.s
+check '--emit-pch with a broken snapshot'
+
+./9cc --emit-pch $tmp/pp/guard.h 2>&1 | grep -q 'defines a function'
+check '--emit-pch with a function'
+
+echo '#if 1' > $tmp/pp/unterminated.c
+./9cc -o $tmp/out $tmp/pp/unterminated.c 2>&1 | grep -q 'unterminated conditional'
+check 'unterminated #if'
+
+# --incremental
+{
+  echo 'int g; char c;'
+  for i in $(seq 100); do
+    echo "int f$i(int x) { char *s = \"f$i\"; if (x > $i) return x - g; return s[1] + c; }"
+  done
+  echo 'int main() { return f1(3) - f2(4); }'
+} > $tmp/inc.c
+./9cc -o $tmp/inc-full.s $tmp/inc.c &&
+  ./9cc --incremental -o $tmp/inc.s $tmp/inc.c && cmp -s $tmp/inc-full.s $tmp/inc.s &&
+  ./9cc --incremental -o $tmp/inc.s $tmp/inc.c && cmp -s $tmp/inc-full.s $tmp/inc.s &&
+  [ -f $tmp/inc.s.fndb ]
+check --incremental
+
+sed -i 's/if (x > 7)/if (x < 7)/; s/^int g; char c;/char g; char c;/' $tmp/inc.c
+./9cc -o $tmp/inc-full.s $tmp/inc.c &&
+  ./9cc --incremental -o $tmp/inc.s $tmp/inc.c && cmp -s $tmp/inc-full.s $tmp/inc.s
+check '--incremental after changes'
+
+# --incremental with macros: a changed macro recompiles the functions
+# after it
+{
+  echo '#include "guard.h"'
+  echo '#define N 1'
+  for i in $(seq 20); do
+    echo "int f$i() { return N + $i; }"
+  done
+  echo 'int main() { return f1() + twice(2); }'
+} > $tmp/pp/inc.c
+./9cc -o $tmp/pp-full1.s $tmp/pp/inc.c &&
+  ./9cc --incremental -o $tmp/pp-inc.s $tmp/pp/inc.c && cmp -s $tmp/pp-full1.s $tmp/pp-inc.s &&
+  sed -i 's/define N 1/define N 2/' $tmp/pp/inc.c &&
+  ./9cc -o $tmp/pp-full2.s $tmp/pp/inc.c && ! cmp -s $tmp/pp-full1.s $tmp/pp-full2.s &&
+  ./9cc --incremental -o $tmp/pp-inc.s $tmp/pp/inc.c && cmp -s $tmp/pp-full2.s $tmp/pp-inc.s
+check '--incremental with macros'
+
+# --stream
+for i in test/*.c; do
+  ./9cc --stream -o $tmp/stream.s $i &&
+    cc -o $tmp/stream $tmp/stream.s -xc test/common && $tmp/stream > /dev/null
+  check "--stream $i"
+done
+
+# -c
+for i in test/*.c; do
+  ./9cc -c -o $tmp/obj.o $i &&
+    cc -o $tmp/obj $tmp/obj.o -xc test/common && $tmp/obj > /dev/null
+  check "-c $i"
+done
+
+# -c: jumps too far for an 8-bit displacement
+{
+  echo 'int main() { int x; int i; x = 0;'
+  echo '  for (i = 0; i < 10; i = i + 1) {'
+  echo '    if (i == 3) {'
+  for i in $(seq 100); do echo '      x = x + 1;'; done
+  echo '    } else x = x + 2; }'
+  echo '  return x; }'
+} > $tmp/far.c
+./9cc -c -o $tmp/far.o $tmp/far.c && cc -o $tmp/far $tmp/far.o && { $tmp/far; [ $? = 118 ]; }
+check '-c with long jumps'
+
+mkdir -p $tmp/obj-out
+./9cc -c -o $tmp/obj-out test/arith.c test/string.c && [ -f $tmp/obj-out/arith.o ] && [ -f $tmp/obj-out/string.o ]
+check '-c with multiple inputs'
+
+./9cc -c --stream $tmp/empty.c 2>&1 | grep -q 'cannot be used'
+check '-c with --stream'
+
+# --link
+cc -c -o $tmp/common.o -xc test/common
+./9cc --link -o $tmp/linked test/arith.c $tmp/common.o && $tmp/linked > /dev/null
+check --link
+
+echo 'int main() { return f(); }' > $tmp/undef.c
+./9cc --link -o $tmp/undef $tmp/undef.c 2> $tmp/undef.log
+[ $? = 1 ] && grep -q 'undefined reference' $tmp/undef.log
+check '--link with a linker error'
+
+echo 'int main() { return x; }' > $tmp/linkbad.c
+! ./9cc --link -o $tmp/linkbad $tmp/linkbad.c 2> /dev/null && [ ! -f $tmp/linkbad ]
+check '--link with a compile error'
+
+./9cc -o $tmp/out test/arith.c $tmp/common.o 2>&1 | grep -q 'need --link'
+check 'object file without --link'
+
+# --run
+for i in test/*.c; do
+  ./9cc --run $i $tmp/common.o > $tmp/run.log && grep -q '^OK$' $tmp/run.log
+  check "--run $i"
+done
+
+echo 'int main() { return 300 - 100; }' | ./9cc --run -
+[ $? = 200 ]
+check '--run exit status'
+
+./9cc --run $tmp/undef.c 2>&1 | grep -q 'undefined reference to f'
+check '--run with an undefined function'
+
+echo 'int assert() { return 0; } int main() { return 0; }' > $tmp/dup.c
+./9cc --run $tmp/dup.c $tmp/common.o 2>&1 | grep -q 'multiple definition of assert'
+check '--run with a multiple definition'
+
+# --whole-program
+cat > $tmp/wp-main.c <<'EOF'
+int count;
+int main() { count = 3; return twice(count); }
+EOF
+cat > $tmp/wp-lib.c <<'EOF'
+int count;
+int twice(int x) { return helper(x) * 2; }
+int helper(int x) { return x; }
+int unused() { return 42; }
+EOF
+./9cc --whole-program -o $tmp/wp.s $tmp/wp-main.c $tmp/wp-lib.c &&
+  [ $(grep -c '^count:' $tmp/wp.s) = 1 ] && ! grep -q '^unused:' $tmp/wp.s &&
+  cc -o $tmp/wp $tmp/wp.s && { $tmp/wp; [ $? = 6 ]; }
+check --whole-program
+
+./9cc --whole-program -c -o $tmp/wp.o $tmp/wp-main.c $tmp/wp-lib.c &&
+  cc -o $tmp/wp $tmp/wp.o && { $tmp/wp; [ $? = 6 ]; }
+check '--whole-program with -c'
+
+./9cc --whole-program --run $tmp/wp-main.c $tmp/wp-lib.c
+[ $? = 6 ]
+check '--whole-program with --run'
+
+echo 'int helper() { return 0; }' > $tmp/wp-dup.c
+./9cc --whole-program $tmp/wp-main.c $tmp/wp-lib.c $tmp/wp-dup.c 2> $tmp/wp.log
+grep -q '^[^ ]*wp-dup.c:1:' $tmp/wp.log &&
+  grep -q 'redefinition of helper; the other one is in .*wp-lib.c' $tmp/wp.log
+check '--whole-program with a redefinition'
+
+echo 'char count;' > $tmp/wp-type.c
+./9cc --whole-program $tmp/wp-main.c $tmp/wp-lib.c $tmp/wp-type.c 2>&1 |
+  grep -q 'conflicting types for count; the other one is in .*wp-main.c'
+check '--whole-program with conflicting types'
+
+echo 'int twice;' > $tmp/wp-kind.c
+./9cc --whole-program $tmp/wp-main.c $tmp/wp-lib.c $tmp/wp-kind.c 2>&1 |
+  grep -q 'conflicting kinds of symbol for twice'
+check '--whole-program with a variable and a function'
+
+./9cc --whole-program --stream $tmp/wp-main.c 2>&1 | grep -q 'cannot be used'
+check '--whole-program with --stream'
+
+# multiple input files
+mkdir -p $tmp/multi $tmp/multi-out
+cp test/*.c test/test.h $tmp/multi
+./9cc -j 4 -o $tmp/multi-out $tmp/multi/*.c
+failed=0
+for i in $tmp/multi/*.c; do
+  s=$tmp/multi-out/$(basename $i .c).s
+  cc -o $tmp/multi.exe $s -xc test/common && $tmp/multi.exe > /dev/null || failed=1
+done
+[ $failed = 0 ]
+check 'multiple inputs'
+
+./9cc $tmp/multi/arith.c $tmp/multi/string.c && [ -f $tmp/multi/arith.s ] && [ -f $tmp/multi/string.s ]
+check 'multiple inputs without -o'
+
+echo 'int main() { return x; }' > $tmp/multi/bad.c
+./9cc -j 2 -o $tmp/multi-out $tmp/multi/arith.c $tmp/multi/bad.c 2>&1 | grep -q 'bad.c:1:'
+check 'multiple inputs error'
+
+# --server and --connect
+./9cc -j 4 --server $tmp/sock &
+server=$!
+for i in $(seq 50); do [ -S $tmp/sock ] && break; sleep 0.1; done
+failed=0
+for i in test/*.c; do
+  f=$tmp/multi/$(basename $i)
+  ./9cc -o $tmp/local.s $f && ./9cc --connect $tmp/sock -o $tmp/remote.s $f &&
+    cmp -s $tmp/local.s $tmp/remote.s || failed=1
+done
+[ $failed = 0 ]
+check '--connect'
+
+mkdir -p $tmp/remote-out
+for i in test/*.c; do echo $tmp/multi/$(basename $i); done |
+  xargs ./9cc --connect $tmp/sock -j 4 -o $tmp/remote-out &&
+  diff -r -q $tmp/multi-out $tmp/remote-out > /dev/null
+check '--connect with multiple inputs'
+
+./9cc --connect $tmp/sock -o $tmp/out $tmp/multi/bad.c 2>&1 | grep -q 'bad.c:1:' &&
+  ./9cc --connect $tmp/sock -o $tmp/remote.s $tmp/multi/arith.c
+check '--connect error'
+
+# Headers are found as the client would find them, in its directory and
+# with its -I, even if another client has the same relative name.
+for i in 1 2; do
+  mkdir -p $tmp/client$i/inc $tmp/client$i/b
+  echo "#define W $i" > $tmp/client$i/inc/w.h
+  echo "#define V 1$i" > $tmp/client$i/b/v.h
+  printf '#include "inc/w.h"\n#include <v.h>\nint main() { return W + V; }\n' > $tmp/client$i/m.c
+done
+failed=0
+for i in 1 2; do
+  (cd $tmp/client$i && $OLDPWD/9cc -I b -o local.s m.c &&
+     $OLDPWD/9cc --connect $tmp/sock -I b -o remote.s m.c && cmp -s local.s remote.s) || failed=1
+done
+[ $failed = 0 ]
+check '--connect with includes'
+kill $server
+
+# The shared memory is freed after every request, while others run.
+./9cc -j 4 --server-memory 0 --server $tmp/sock2 &
+server=$!
+for i in $(seq 50); do [ -S $tmp/sock2 ] && break; sleep 0.1; done
+rm -rf $tmp/remote-out && mkdir -p $tmp/remote-out
+for i in 1 2 3; do for j in test/*.c; do echo $tmp/multi/$(basename $j); done; done |
+  xargs ./9cc --connect $tmp/sock2 -j 4 -o $tmp/remote-out &&
+  diff -r -q $tmp/multi-out $tmp/remote-out > /dev/null
+check '--server-memory'
+kill $server
+
+# lib9cc: compile in memory on several threads; errors come back to the caller
+cat > $tmp/lib.c <<'EOF'
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "lib9cc.h"
+
+static char *good = "int add(int a, int b) { return a+b; } int main() { return add(1, 2); }";
+static char *bad = "int main() { return x; }";
+
+static void *run(void *arg) {
+    CompileContext ctx = {"good.c"};
+    for (int i = 0; i < 50; i++) {
+        ctx.filename = "good.c";
+        if (compile(&ctx, good, strlen(good)) || !strstr(ctx.asm_text, "add:"))
+            return "good";
+        ctx.filename = "bad.c";
+        if (compile(&ctx, bad, strlen(bad)) != -1 || !strstr(ctx.diag, "bad.c:1:"))
+            return "bad";
+    }
+    compile_context_free(&ctx);
+    return NULL;
+}
+
+int main() {
+    pthread_t thr[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&thr[i], NULL, run, NULL);
+    for (int i = 0; i < 4; i++) {
+        void *ret;
+        pthread_join(thr[i], &ret);
+        if (ret) {
+            printf("%s\n", (char *)ret);
+            return 1;
+        }
+    }
+    return 0;
+}
+EOF
+cc -pthread -I. -o $tmp/lib $tmp/lib.c lib9cc.a && $tmp/lib
+check lib9cc
+
 echo OK
\ No newline at end of file
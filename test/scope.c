@@ -0,0 +1,45 @@
+#include "test.h"
+
+// Redeclaring v6 and v36 in the second block once put a second entry for
+// each into the table of visible names, after a deleted one.
+int collide() {
+    int v6=6; int v25=25; int v18=18; int v1=1; int v36=36; int v19=19; int v21=21;
+    { int v35=35; int v10=10; int v7=7; int v37=37; int v3=3; }
+    {
+        int v6=-6; int v20=20; int v29=29; int v15=15; int v38=38; int v36=-36;
+        int v33=33; int v14=14; int v0=0; int v17=17; int v27=27; int v13=13;
+        int v31=31; int v9=9;
+        ASSERT(-6, v6);
+        ASSERT(-36, v36);
+    }
+    return v6 + v36;
+}
+
+// Every level declares a-m again and, on odd levels, n-z as well, so
+// names are shadowed, dropped and restored many times over. outer is the
+// value that n-z have on entry.
+#define HALF(n) int a=n; int b=n; int c=n; int d=n; int e=n; int f=n; int g=n; \
+    int h=n; int i=n; int j=n; int k=n; int l=n; int m=n;
+#define FULL(n) HALF(n) int n_=n; int o=n; int p=n; int q=n; int r=n; int s=n; \
+    int t=n; int u=n; int v=n; int w=n; int x=n; int y=n; int z=n;
+#define CHECK(n, outer) ASSERT(n, a); ASSERT(n, m); ASSERT(outer, n_); ASSERT(outer, z);
+
+#define L0(n, outer) { HALF(n) CHECK(n, outer) }
+#define L1(n, outer) { FULL(n) L0(n+1, n) L0(n+2, n) CHECK(n, n) }
+#define L2(n, outer) { HALF(n) L1(n+1, outer) L1(n+2, outer) CHECK(n, outer) }
+#define L3(n, outer) { FULL(n) L2(n+1, n) L2(n+2, n) CHECK(n, n) }
+#define L4(n, outer) { HALF(n) L3(n+1, outer) L3(n+2, outer) CHECK(n, outer) }
+#define L5(n, outer) { FULL(n) L4(n+1, n) L4(n+2, n) CHECK(n, n) }
+#define L6(n, outer) { HALF(n) L5(n+1, outer) L5(n+2, outer) CHECK(n, outer) }
+
+int main() {
+    ASSERT(42, collide());
+
+    FULL(0)
+    L6(1, 0)
+    L6(2, 0)
+    CHECK(0, 0)
+
+    printf("OK\n");
+    return 0;
+}
@@ -45,6 +45,8 @@ int main() {
 
     ASSERT(2, ({ int x=2; { int x=3; } x; }));
     ASSERT(2, ({ int x=2; { int x=3; } int y=4; x; }));
+    ASSERT(3, ({ int x=2; int y; { int x=3; { int x=4; } y=x; } y; }));
+    ASSERT(7, ({ int x=2; int y=3; { int x=4; y=x+1; } x+y; }));
     ASSERT(3, ({ int x=2; { x=3; } x; }));
 
     printf("OK\n");
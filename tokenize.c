@@ -1,23 +1,144 @@
 #include "9cc.h"
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int opt_jobs = 1;
+
+// 今読んでいるファイル (スレッドごと)
+static _Thread_local char *current_filename;
+static _Thread_local char *current_input;
+
+// #includeで読み込んだファイルも含めた、この翻訳単位の入力ファイル。
+// エラー箇所がどのファイルにあるかを調べるのに使う
+typedef struct {
+    char *name;
+    char *contents;
+    size_t size;
+} InputFile;
+
+static _Thread_local InputFile *input_files;
+static _Thread_local int input_file_count;
+
+// 入力の一部分。大きな入力はいくつかのChunkに分けて並列にトークナイズする
+typedef struct {
+    char *start;
+    char *end;
+    Arena arena;     // このChunkのトークンの割り当て先
+    Arena str_arena; // このChunkの文字列リテラルの中身の割り当て先
+    Token head;
+    Token *tail;
+    bool has_space;  // 前のChunkの改行の直後から始まる
+
+    // 最初のエラー
+    jmp_buf jmp;
+    char *error_loc;
+    char *error_msg;
+} Chunk;
+
+// 並列トークナイズで1スレッドに割り当てる最小の大きさ
+#define MIN_CHUNK_SIZE (256 * 1024)
+
+// 処理中のChunk
+static _Thread_local Chunk *current_chunk;
+
+// トークンはプリプロセッサが配列に詰め直すまでの間だけ使うのでlist_arenaに、
+// 文字列リテラルの中身は詰め直したトークンからも指すのでtoken_arenaに置く
+static Arena *tok_arena(void) {
+    return current_chunk ? &current_chunk->arena : &list_arena;
+}
+
+static Arena *str_arena(void) {
+    return current_chunk ? &current_chunk->str_arena : &token_arena;
+}
 
-static char *current_filename;
-static char *current_input;
+_Thread_local FILE *error_file;
+_Thread_local jmp_buf *error_jmp;
+
+static FILE *diag_file(void) {
+    return error_file ? error_file : stderr;
+}
+
+// エラーを報告した後、呼び出し元に戻るか終了する
+static _Noreturn void fail(void) {
+    if (error_jmp)
+        longjmp(*error_jmp, 1);
+    exit(1);
+}
 
 // エラーを報告するための関数
 // printfと同じ引数を取る
-void error(char *fmt, ...) {
+_Noreturn void error(char *fmt, ...) {
+    FILE *out = diag_file();
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    fail();
+}
+
+// Registers a file read for this translation unit so that errors in
+// it can be reported with its name and line number.
+void add_input_file(char *name, char *contents) {
+    for (int i = 0; i < input_file_count; i++)
+        if (input_files[i].contents == contents)
+            return;
+
+    input_files = realloc(input_files, sizeof(InputFile) * (input_file_count + 1));
+    input_files[input_file_count++] = (InputFile){name, contents, strlen(contents)};
+}
+
+// Starts a new translation unit whose main file is given.
+static void set_input(char *name, char *contents) {
+    current_filename = name;
+    current_input = contents;
+    input_file_count = 0;
+    add_input_file(name, contents);
+}
+
+static InputFile *find_input_file(char *loc) {
+    for (int i = 0; i < input_file_count; i++) {
+        InputFile *file = &input_files[i];
+        if (file->contents <= loc && loc <= file->contents + file->size)
+            return file;
+    }
+    return NULL;
+}
+
+// Returns the name of the file that loc points into, or NULL.
+char *input_file_name(char *loc) {
+    InputFile *file = find_input_file(loc);
+    return file ? file->name : NULL;
 }
 
 // エラー箇所を報告する
-static void verror_at(char *loc, char *fmt, va_list ap) {
+static _Noreturn void verror_at(char *loc, char *fmt, va_list ap) {
+    // Chunkの処理中なら、エラーを記録しておいて呼び出し元に戻る。
+    // どのChunkのエラーを報告するかは全スレッドの終了後に決める
+    if (current_chunk) {
+        size_t len;
+        FILE *out = open_memstream(&current_chunk->error_msg, &len);
+        vfprintf(out, fmt, ap);
+        fclose(out);
+        current_chunk->error_loc = loc;
+        longjmp(current_chunk->jmp, 1);
+    }
+
+    // マクロ展開で作られたトークンはどのファイルにもない
+    InputFile *file = find_input_file(loc);
+    FILE *out = diag_file();
+    if (!file) {
+        fprintf(out, "%s: ", current_filename);
+        vfprintf(out, fmt, ap);
+        fprintf(out, "\n");
+        fail();
+    }
+
     // find a line containing 'loc'
     char *line = loc;
-    while (current_input < line && line[-1] != '\n')
+    while (file->contents < line && line[-1] != '\n')
         line--;
     
     char *end = loc;
@@ -26,39 +147,41 @@ static void verror_at(char *loc, char *fmt, va_list ap) {
 
     // get a line number.
     int line_no = 1;
-    for (char *p = current_input; p < line; p++)
+    for (char *p = file->contents; p < line; p++)
         if (*p == '\n')
             line_no++;
     
     // print out the line
-    int indent = fprintf(stderr, "%s:%d: ", current_filename, line_no);
-    fprintf(stderr, "%.*s\n", (int)(end - line), line);
+    int indent = fprintf(out, "%s:%d: ", file->name, line_no);
+    fprintf(out, "%.*s\n", (int)(end - line), line);
 
     // show the error message
     int pos = loc - line + indent;
 
-    fprintf(stderr, "%*s", pos, "");
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    fprintf(out, "%*s", pos, "");
+    fprintf(out, "^ ");
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    fail();
 }
 
-void error_at(char *loc, char *fmt, ...) {
+_Noreturn void error_at(char *loc, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     verror_at(loc, fmt, ap);
 }
 
-void error_tok(Token *tok, char *fmt, ...) {
+_Noreturn void error_tok(Token *tok, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     verror_at(tok->loc, fmt, ap);
 }
 
 // トークンが期待している記号か確認
+// 先頭の1文字で大半の不一致を弾いてからmemcmpする
 bool equal(Token *tok, char *op) {
-    return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+    return *tok->loc == *op && memcmp(tok->loc, op, tok->len) == 0 &&
+           op[tok->len] == '\0';
 }
 
 // トークンが期待している記号の時にはトークンを１つ読み進める。
@@ -78,27 +201,69 @@ bool consume(Token **rest, Token *tok, char *str) {
     return false;
 }
 
+// 以下はequal/skip/consumeの番号版。記号とキーワードはトークナイズ時に
+// 番号を振ってあるので、整数の比較1回で済む
+bool equal_id(Token *tok, int id) {
+    return tok->id == id;
+}
+
+Token *skip_id(Token *tok, int id) {
+    if (tok->id != id)
+        error_tok(tok, "'%s'ではありません", token_id_name(id));
+    return tok->next;
+}
+
+bool consume_id(Token **rest, Token *tok, int id) {
+    if (tok->id == id) {
+        *rest = tok->next;
+        return true;
+    }
+    *rest = tok;
+    return false;
+}
+
 // 新しいトークンを作成する
 static Token *new_token(TokenKind kind, char *start, char *end) {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = arena_alloc(tok_arena(), sizeof(Token));
     tok->kind = kind;
     tok->loc = start;
     tok->len = end - start;
     return tok;
 }
 
-static bool startswith(char *p, char *q) {
-    return strncmp(p, q, strlen(q)) == 0;
+// 文字の分類表。tokenize()の内側のループで1文字ずつ関数を呼ばずに済むよう、
+// 空白と識別子の文字をビットで引けるようにしておく
+enum {
+    C_SPACE = 1,
+    C_IDENT1 = 2,
+    C_IDENT2 = 4,
+};
+
+static unsigned char char_class[256];
+
+static void init_char_class(void) {
+    for (int c = 0; c < 256; c++) {
+        if (isspace(c))
+            char_class[c] |= C_SPACE;
+        if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_')
+            char_class[c] |= C_IDENT1 | C_IDENT2;
+        if ('0' <= c && c <= '9')
+            char_class[c] |= C_IDENT2;
+    }
 }
 
 // 識別子の先頭文字に使える文字か
 static bool is_ident1(char c) {
-    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+    return char_class[(unsigned char)c] & C_IDENT1;
 }
 
 // 識別子の2文字目以降に使える文字か
 static bool is_ident2(char c) {
-    return is_ident1(c) || ('0' <= c && c <= '9');
+    return char_class[(unsigned char)c] & C_IDENT2;
+}
+
+static bool is_space(char c) {
+    return char_class[(unsigned char)c] & C_SPACE;
 }
 
 static int from_hex(char c) {
@@ -109,21 +274,60 @@ static int from_hex(char c) {
     return c - 'A' + 10;
 }
 
-// punctuatorの長さを返す関数
-static int read_punct(char *p) {
-    if (startswith(p, "==") || startswith(p, "!=") ||
-        startswith(p, "<=") || startswith(p, ">="))
-        return 2;
-    return ispunct(*p) ? 1 : 0;
+// 2文字の記号とキーワードの綴り。番号から128を引いた位置に並べる
+static char *id_names[] = {
+    "==", "!=", "<=", ">=", "##", "&&", "||", "<<", ">>",
+    "return", "if", "else", "for", "while", "int", "char", "sizeof",
+};
+
+// 記号・キーワードの番号から綴りを返す
+char *token_id_name(int id) {
+    static _Thread_local char buf[2];
+    if (id >= P_EQ)
+        return id_names[id - P_EQ];
+    buf[0] = id;
+    return buf;
 }
 
-static bool is_keyword(Token *tok) {
-    static char *kw[] = {"return", "if", "else", "for", "while", "int", "char", "sizeof"};
+// punctuatorの長さを返し、その番号を*idに入れる
+static int read_punct(char *p, int *id) {
+    // 2文字の記号。1文字目と2文字目の組で引く
+    for (int i = P_EQ; i <= P_SHR; i++) {
+        char *op = id_names[i - P_EQ];
+        if (p[0] == op[0] && p[1] == op[1]) {
+            *id = i;
+            return 2;
+        }
+    }
 
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-        if (equal(tok, kw[i]))
-            return true;
-    return false;
+    if (!ispunct(*p))
+        return 0;
+    *id = *p;
+    return 1;
+}
+
+// キーワードの完全ハッシュ表。先頭と末尾の文字と長さから位置が決まり、
+// キーワード同士は衝突しない (init_keywordsで確かめる)
+#define KEYWORD_HASH(s, len) (((s)[0] + (s)[(len) - 1] + ((len) << 2)) & 15)
+
+static int keyword_table[16];
+
+static void init_keywords(void) {
+    for (int id = KW_RETURN; id < TOKEN_ID_END; id++) {
+        char *name = id_names[id - P_EQ];
+        int h = KEYWORD_HASH(name, strlen(name));
+        assert(!keyword_table[h]);
+        keyword_table[h] = id;
+    }
+}
+
+// キーワードならその番号を、そうでなければ0を返す
+static int keyword_id(char *name, int len) {
+    int id = keyword_table[KEYWORD_HASH(name, len)];
+    if (!id)
+        return 0;
+    char *kw = id_names[id - P_EQ];
+    return strncmp(name, kw, len) == 0 && kw[len] == '\0' ? id : 0;
 }
 
 static int read_escaped_char(char **new_pos, char* p) {
@@ -167,20 +371,23 @@ static int read_escaped_char(char **new_pos, char* p) {
     }
 }
 
+// 文字列リテラルの終わりの'"'を探す。strcspnは特別な文字まで
+// まとめて読み飛ばせる
 static char *string_literal_end(char *p) {
     char *start = p;
-    for (; *p != '"'; p++) {
+    for (;;) {
+        p += strcspn(p, "\"\\\n");
+        if (*p == '"')
+            return p;
         if (*p == '\n' || *p == '\0')
             error_at(start, "unclosed string literal");
-        if (*p == '\\')
-            p++;
+        p += 2;
     }
-    return p;
 }
 
 static Token *read_string_literal(char *start) {
     char *end = string_literal_end(start + 1);
-    char *buf = calloc(1, end - start);
+    char *buf = arena_alloc(str_arena(), end - start);
     int len = 0;
 
     for (char *p = start + 1; p < end;) {
@@ -191,36 +398,87 @@ static Token *read_string_literal(char *start) {
     }
 
     Token *tok = new_token(TK_STR, start, end + 1);
-    tok->ty = array_of(ty_char, len + 1);
-    tok->str = buf;
+    tok->str = arena_alloc(str_arena(), sizeof(StrLiteral));
+    tok->str->data = buf;
+    tok->str->len = len + 1;
     return tok;
 }
 
-static void convert_keywords(Token *tok) {
-    for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-        if (is_keyword(t))
-            t->kind = TK_KEYWORD;
-}
+// 空白とコメント以外の位置pからトークンを1つ読み、*restをその直後に進める
+static Token *read_token(char **rest, char *p) {
+    // 数値の場合
+    if (isdigit(*p)) {
+        Token *tok = new_token(TK_NUM, p, p);
+        tok->val = strtoul(p, rest, 10);
+        tok->len = *rest - p;
+        return tok;
+    }
 
-// 入力文字列pをトークナイズしてそれを返す
-static Token *tokenize(char *filename, char *p) {
-    current_filename = filename;
-    current_input = p;
-    Token head = {};
-    Token *cur = &head;
+    // string literal
+    if (*p == '"') {
+        Token *tok = read_string_literal(p);
+        *rest = p + tok->len;
+        return tok;
+    }
 
-    while (*p) {
-        // 空白文字をスキップ
-        if (isspace(*p)) {
+    // 識別子 or keyword
+    if (is_ident1(*p)) {
+        char *start = p;
+        do {
             p++;
+        } while (is_ident2(*p));
+        Token *tok = new_token(TK_IDENT, start, p);
+        tok->name = intern(start, p - start);
+        tok->id = keyword_id(start, p - start);
+        if (tok->id)
+            tok->kind = TK_KEYWORD;
+        *rest = p;
+        return tok;
+    }
+
+    // Punctuator
+    int id;
+    int punct_len = read_punct(p, &id);
+    if (punct_len) {
+        *rest = p + punct_len;
+        Token *tok = new_token(TK_PUNCT, p, p + punct_len);
+        tok->id = id;
+        return tok;
+    }
+
+    error_at(p, "トークナイズできません");
+    return NULL;
+}
+
+// [p, end)をトークナイズしてcurの後ろにつなげ、最後のトークンを返す。
+// at_bolはpが行頭かどうか、has_spaceはpの前に空白があるかどうか。
+// プリプロセッサのために、各トークンが行頭にあるかどうかと、前に空白が
+// あるかどうかを記録する
+static Token *tokenize_range(Token *cur, char *p, char *end, bool at_bol, bool has_space) {
+    while (p < end) {
+        // 空白文字をスキップ
+        if (is_space(*p)) {
+            do {
+                if (*p == '\n')
+                    at_bol = true;
+                p++;
+            } while (is_space(*p));
+            has_space = true;
+            continue;
+        }
+
+        // 行の継続は空白として扱う
+        if (p[0] == '\\' && p[1] == '\n') {
+            p += 2;
+            has_space = true;
             continue;
         }
 
         // 行コメントをスキップ
+        // 入力は必ず改行で終わるのでstrchrはNULLを返さない
         if (strncmp(p, "//", 2) == 0) {
-            p += 2;
-            while (*p != '\n')
-                p++;
+            p = strchr(p + 2, '\n');
+            has_space = true;
             continue;
         }
 
@@ -230,54 +488,199 @@ static Token *tokenize(char *filename, char *p) {
             if (!q)
                 error_at(p, "コメントが閉じられていません");
             p = q + 2;
+            has_space = true;
             continue;
         }
 
-        // 数値の場合
-        if (isdigit(*p)) {
-            cur = cur->next = new_token(TK_NUM, p, p);
-            char *q = p;
-            cur->val = strtoul(p, &p, 10);
-            cur->len = p - q;
+        cur = cur->next = read_token(&p, p);
+        cur->at_bol = at_bol;
+        cur->has_space = has_space;
+        at_bol = has_space = false;
+    }
+    return cur;
+}
+
+static void *tokenize_chunk(void *arg) {
+    Chunk *chunk = arg;
+    current_chunk = chunk;
+
+    chunk->tail = &chunk->head;
+    if (setjmp(chunk->jmp) == 0)
+        chunk->tail = tokenize_range(&chunk->head, chunk->start, chunk->end, true,
+                                     chunk->has_space);
+
+    current_chunk = NULL;
+    return NULL;
+}
+
+// 文字列リテラルを読み飛ばす。string_literal_end()と同じ規則で進むが、
+// 閉じていなくてもエラーにはせず、改行の手前で止まる
+static char *skip_string_literal(char *p) {
+    for (;;) {
+        p += strcspn(p, "\"\\\n");
+        if (*p == '"')
+            return p + 1;
+        if (*p == '\n' || *p == '\0')
+            return p;
+        p += 2;
+    }
+}
+
+// 入力を最大n個のChunkに分け、その数を返す。
+// 区切りはコメントや文字列リテラルの外にある、行の継続でない改行の直後に
+// だけ置くので、どのChunkも行頭から、逐次処理と同じ状態でトークナイズを
+// 始められる
+static int split_input(Chunk *chunks, int n, char *p, char *end) {
+    int size = (end - p) / n;
+    int i = 0;
+
+    chunks[0].start = p;
+    char *next = p + size;
+
+    while (*p && i < n - 1) {
+        p += strcspn(p, "\"/\n");
+
+        if (*p == '\n') {
+            p++;
+            if (p >= next && p < end && p[-2] != '\\') {
+                chunks[i++].end = p;
+                chunks[i].start = p;
+                chunks[i].has_space = true;
+                next = p + size;
+            }
             continue;
         }
 
-        // string literal
         if (*p == '"') {
-            cur = cur->next = read_string_literal(p);
-            p += cur->len;
+            p = skip_string_literal(p + 1);
             continue;
         }
 
-        // 識別子 or keyword
-        if (is_ident1(*p)) {
-            char *start = p;
-            do {
-                p++;
-            } while (is_ident2(*p));
-            cur = cur->next = new_token(TK_IDENT, start, p);
+        if (strncmp(p, "//", 2) == 0) {
+            p = strchr(p + 2, '\n');
             continue;
         }
 
-        // Punctuator
-        int punct_len = read_punct(p);
-        if (punct_len) {
-            cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
-            p += cur->len;
+        if (strncmp(p, "/*", 2) == 0) {
+            char *q = strstr(p + 2, "*/");
+            if (!q)
+                break;
+            p = q + 2;
             continue;
         }
 
-        error_at(p, "トークナイズできません");
+        if (*p)
+            p++;
     }
 
-    cur = cur->next = new_token(TK_EOF, p, p);
-    convert_keywords(head.next);
+    chunks[i].end = end;
+    return i + 1;
+}
+
+// 入力を分割して、各Chunkを別々のスレッドでトークナイズする
+static Token *tokenize_parallel(Token *cur, char *p, char *end, int n) {
+    Chunk *chunks = calloc(n, sizeof(Chunk));
+    n = split_input(chunks, n, p, end);
+
+    pthread_t *threads = calloc(n, sizeof(pthread_t));
+    for (int i = 1; i < n; i++)
+        if (pthread_create(&threads[i], NULL, tokenize_chunk, &chunks[i]))
+            error("cannot create a thread");
+    tokenize_chunk(&chunks[0]);
+    for (int i = 1; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    // エラーがあってもトークンは解放できるようにarenaを先にまとめておく。
+    // 一番前のエラーが、逐次処理で最初に見つかるエラーと同じになる
+    Chunk *failed = NULL;
+    for (int i = 0; i < n; i++) {
+        arena_merge(&list_arena, &chunks[i].arena);
+        arena_merge(&token_arena, &chunks[i].str_arena);
+        if (chunks[i].error_msg && !failed)
+            failed = &chunks[i];
+        if (chunks[i].head.next) {
+            cur->next = chunks[i].head.next;
+            cur = chunks[i].tail;
+        }
+    }
+
+    char *error_loc = failed ? failed->error_loc : NULL;
+    char *error_msg = failed ? failed->error_msg : NULL;
+    free(threads);
+    free(chunks);
+    if (error_msg)
+        error_at(error_loc, "%s", error_msg);
+    return cur;
+}
+
+static void init_tables_once(void) {
+    init_char_class();
+    init_keywords();
+}
+
+static void init_tables(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_tables_once);
+}
+
+// 入力文字列pをトークナイズしてそれを返す
+static Token *tokenize(char *p) {
+    init_tables();
+
+    char *end = p + strlen(p);
+    Token head = {};
+    Token *cur = &head;
+
+    int n = (end - p) / MIN_CHUNK_SIZE;
+    if (n > opt_jobs)
+        n = opt_jobs;
+
+    if (n > 1)
+        cur = tokenize_parallel(cur, p, end, n);
+    else
+        cur = tokenize_range(cur, p, end, true, false);
+
+    cur = cur->next = new_token(TK_EOF, end, end);
     return head.next;
 }
 
+// Maps a regular file into memory without copying it. The tokenizer
+// needs the input to end with "\n\0"; the bytes past EOF in the last
+// page are zero, so that holds for free if the file ends with a newline
+// and does not fill its last page exactly. Otherwise returns NULL and
+// the caller falls back to reading a copy.
+static char *map_file(FILE *fp, size_t *len) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return NULL;
+
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if (st.st_size % pagesize == 0)
+        return NULL;
+
+    char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    if (buf[st.st_size - 1] != '\n') {
+        munmap(buf, st.st_size);
+        return NULL;
+    }
+    *len = st.st_size;
+    return buf;
+}
+
 // returns the contents of a given file
-static char *read_file(char *path) {
+char *read_file(char *path) {
+    size_t mapped;
+    return read_file2(path, &mapped);
+}
+
+// Same as read_file(), but sets *mapped to the length of the mapping if
+// the file was mapped, or to 0 if the contents are a malloc'ed copy.
+char *read_file2(char *path, size_t *mapped) {
     FILE *fp;
+    *mapped = 0;
 
     if (strcmp(path, "-") == 0) {
         // By convention, read from stdin if a given filename is "-"
@@ -286,6 +689,12 @@ static char *read_file(char *path) {
         fp = fopen(path, "r");
         if (!fp)
             error("cannot open %s: %s", path, strerror(errno));
+
+        char *buf = map_file(fp, mapped);
+        if (buf) {
+            fclose(fp);
+            return buf;
+        }
     }
 
     char *buf;
@@ -312,6 +721,120 @@ static char *read_file(char *path) {
     return buf;
 }
 
+// Reads a file and makes it the input that error messages refer to.
+char *read_input(char *path) {
+    set_input(path, read_file(path));
+    return current_input;
+}
+
 Token *tokenize_file(char *path) {
-    return tokenize(path, read_file(path));
+    return tokenize(read_input(path));
+}
+
+// Tokenizes a string that ends with "\n\0". filename is used in
+// error messages.
+Token *tokenize_string(char *filename, char *p) {
+    set_input(filename, p);
+    return tokenize(p);
+}
+
+// Tokenizes p, the contents of a file included by the input. The file
+// is added to those that error messages can refer to.
+Token *tokenize_include(char *path, char *p) {
+    add_input_file(path, p);
+    return tokenize(p);
+}
+
+// Skips a preprocessing directive starting at p up to the newline that
+// ends it.
+static char *skip_directive(char *p) {
+    for (;;) {
+        p += strcspn(p, "\\\n");
+        if (*p != '\\')
+            return p;
+        p += p[1] ? 2 : 1;
+    }
+}
+
+// Returns the end of the top-level declaration starting at p: just after
+// a ';' or '}' outside any braces, skipping comments, string literals and
+// preprocessing directives.
+char *toplevel_end(char *p) {
+    int depth = 0;
+    bool at_bol = p == current_input || p[-1] == '\n';
+
+    while (*p) {
+        if (at_bol) {
+            char *q = p + strspn(p, " \t");
+            if (*q == '#')
+                p = skip_directive(q);
+            at_bol = false;
+        }
+
+        p += strcspn(p, "\"/{};\n");
+
+        if (*p == '\n') {
+            p++;
+            at_bol = true;
+            continue;
+        }
+
+        if (*p == '"') {
+            p = skip_string_literal(p + 1);
+            continue;
+        }
+
+        if (strncmp(p, "//", 2) == 0) {
+            p = strchr(p + 2, '\n');
+            continue;
+        }
+
+        if (strncmp(p, "/*", 2) == 0) {
+            char *q = strstr(p + 2, "*/");
+            if (!q)
+                return p + strlen(p);
+            p = q + 2;
+            continue;
+        }
+
+        if (*p == '{') {
+            depth++;
+        } else if (*p == '}') {
+            if (--depth <= 0)
+                return p + 1;
+        } else if (*p == ';') {
+            if (depth == 0)
+                return p + 1;
+        }
+
+        if (*p)
+            p++;
+    }
+    return p;
+}
+
+// Tokenizes [start, end) of the input returned by read_input(), which
+// must not split a token. The token list ends with TK_EOF.
+Token *tokenize_span(char *start, char *end) {
+    init_tables();
+
+    Token head = {};
+    bool at_bol = start == current_input || start[-1] == '\n';
+    bool has_space = start != current_input && is_space(start[-1]);
+    Token *cur = tokenize_range(&head, start, end, at_bol, has_space);
+    cur->next = new_token(TK_EOF, end, end);
+    return head.next;
+}
+
+// Tokenizes the next top-level declaration of the input returned by
+// read_input() and advances *rest past it. The token list ends with
+// TK_EOF. Returns NULL at the end of the input.
+Token *tokenize_toplevel(char **rest) {
+    char *p = *rest;
+    if (!*p)
+        return NULL;
+
+    char *end = toplevel_end(p);
+    *rest = end;
+    return tokenize_span(p, end);
 }
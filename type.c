@@ -1,58 +1,91 @@
 #include "9cc.h"
 
-Type *ty_char = &(Type){TY_CHAR, 1};
-Type *ty_int = &(Type){TY_INT, 8};
+_Thread_local Type builtin_char = {TY_CHAR, 1};
+_Thread_local Type builtin_int = {TY_INT, 8};
 
 bool is_integer(Type *ty) {
     return ty->kind == TY_CHAR || ty->kind == TY_INT;
 }
 
 Type *copy_type(Type *ty) {
-    Type *ret = calloc(1, sizeof(Type));
+    Type *ret = arena_alloc(&type_arena, sizeof(Type));
     *ret = *ty;
+    ret->origin = ty;
     return ret;
 }
 
 Type *pointer_to(Type *base) {
-    Type *ty = calloc(1, sizeof(Type));
+    if (base->pointer)
+        return base->pointer;
+
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_PTR;
     ty->size = 8;
     ty->base = base;
+    base->pointer = ty;
     return ty;
 }
 
 Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_FUNC;
     ty->return_ty = return_ty;
     return ty;
 }
 
 Type *array_of(Type *base, int len) {
-    Type *ty = calloc(1, sizeof(Type));
+    for (Type *ty = base->arrays; ty; ty = ty->array_next)
+        if (ty->array_len == len)
+            return ty;
+
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_ARRAY;
     ty->size = base->size * len;
     ty->base = base;
     ty->array_len = len;
+    ty->array_next = base->arrays;
+    base->arrays = ty;
     return ty;
 }
 
+// Frees all types of this thread. The derived types cached on the
+// built-in types go away with them.
+void release_types(void) {
+    arena_release(&type_arena);
+    builtin_char = (Type){TY_CHAR, 1};
+    builtin_int = (Type){TY_INT, 8};
+}
+
 void add_type(Node *node) {
     if (!node || node->ty)
         return;
     
-    add_type(node->lhs);
-    add_type(node->rhs);
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    add_type(node->init);
-    add_type(node->inc);
-
-    for (Node *n = node->body; n; n = n->next)
-        add_type(n);
-    for (Node *n = node->args; n; n = n->next)
-        add_type(n);
+    // Only the fields of the node's own kind are valid.
+    switch (node->kind) {
+    case ND_IF:
+    case ND_FOR:
+        add_type(node->cond);
+        add_type(node->then);
+        add_type(node->els);
+        add_type(node->init);
+        add_type(node->inc);
+        break;
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        for (Node *n = node->body; n; n = n->next)
+            add_type(n);
+        break;
+    case ND_FUNCALL:
+        for (Node *n = node->args; n; n = n->next)
+            add_type(n);
+        break;
+    case ND_VAR:
+    case ND_NUM:
+        break;
+    default:
+        add_type(node->lhs);
+        add_type(node->rhs);
+    }
 
     switch (node->kind) {
     case ND_ADD:
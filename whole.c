@@ -0,0 +1,134 @@
+// Whole-program mode (--whole-program). The input files are parsed one
+// after another into a single list of globals, which is checked and
+// trimmed here before it is compiled as one unit.
+//
+// A global variable may be declared in several files, as a tentative
+// definition, as long as the types agree; one definition is kept. A
+// function may be defined only once, and a name may not be both a
+// function and a variable. Functions that cannot be reached from main()
+// are removed. Without a main(), all functions are kept.
+#include "9cc.h"
+
+// prev has no token if it came from a precompiled header, and no file
+// name if it was in a header included by an earlier file.
+static void conflict(Obj *var, Obj *prev, char *msg) {
+    char *file = "a precompiled header";
+    if (prev->tok) {
+        file = input_file_name(prev->tok->loc);
+        if (!file)
+            file = "another file";
+    }
+    if (var->tok)
+        error_tok(var->tok, "%s %s; the other one is in %s", msg, var->name, file);
+    error("%s %s", msg, var->name);
+}
+
+static void mark(Node *node, HashMap *fns, HashMap *live);
+
+static void mark_fn(Obj *fn, HashMap *fns, HashMap *live) {
+    if (!fn || hashmap_get(live, fn->name))
+        return;
+    hashmap_put(live, fn->name, fn);
+    mark(fn->body, fns, live);
+}
+
+// Marks the functions that node calls or takes the address of.
+static void mark(Node *node, HashMap *fns, HashMap *live) {
+    if (!node)
+        return;
+
+    switch (node->kind) {
+    case ND_NUM:
+        return;
+    case ND_VAR:
+        if (node->var->is_function)
+            mark_fn(hashmap_get(fns, node->var->name), fns, live);
+        return;
+    case ND_FUNCALL:
+        mark_fn(hashmap_get(fns, node->funcname), fns, live);
+        for (Node *n = node->args; n; n = n->next)
+            mark(n, fns, live);
+        return;
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+        for (Node *n = node->body; n; n = n->next)
+            mark(n, fns, live);
+        return;
+    case ND_IF:
+    case ND_FOR:
+        mark(node->cond, fns, live);
+        mark(node->then, fns, live);
+        mark(node->els, fns, live);
+        mark(node->init, fns, live);
+        mark(node->inc, fns, live);
+        return;
+    default:
+        mark(node->lhs, fns, live);
+        mark(node->rhs, fns, live);
+    }
+}
+
+// Merges the globals of several files and removes unreachable
+// functions. progs[i] is the list of file i, most recent first like the
+// result of parse_toplevel(), and so is the result, as if the files had
+// been parsed as one.
+Obj *link_program(Obj **progs, int n, int *nremoved) {
+    HashMap syms = {};
+    HashMap fns = {};
+    Obj *prog = NULL;
+
+    for (int i = 0; i < n; i++) {
+        // Visit the file's globals in source order, so that a conflict is
+        // reported at the later definition.
+        Obj *vars = NULL;
+        for (Obj *var = progs[i], *next; var; var = next) {
+            next = var->next;
+            var->next = vars;
+            vars = var;
+        }
+
+        for (Obj *var = vars, *next; var; var = next) {
+            next = var->next;
+            Obj *prev = hashmap_get(&syms, var->name);
+
+            if (prev) {
+                if (var->is_function != prev->is_function)
+                    conflict(var, prev, "conflicting kinds of symbol for");
+                if (var->is_function)
+                    conflict(var, prev, "redefinition of");
+                // Types are interned, so equal types are the same object.
+                if (var->ty != prev->ty)
+                    conflict(var, prev, "conflicting types for");
+                continue;
+            }
+
+            hashmap_put(&syms, var->name, var);
+            if (var->is_function)
+                hashmap_put(&fns, var->name, var);
+            var->next = prog;
+            prog = var;
+        }
+    }
+
+    *nremoved = 0;
+    Obj *main_fn = hashmap_get(&fns, "main");
+    if (main_fn) {
+        HashMap live = {};
+        mark_fn(main_fn, &fns, &live);
+
+        Obj **p = &prog;
+        while (*p) {
+            if ((*p)->is_function && !hashmap_get(&live, (*p)->name)) {
+                *p = (*p)->next;
+                (*nremoved)++;
+            } else {
+                p = &(*p)->next;
+            }
+        }
+        free(live.buckets);
+    }
+
+    free(syms.buckets);
+    free(fns.buckets);
+    return prog;
+}